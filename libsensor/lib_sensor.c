@@ -15,6 +15,7 @@
 #ifdef _MSC_VER
 #include <Winsock2.h>
 #include <windows.h>
+#include <io.h>
 #else
 #include <unistd.h>
 #include <sys/select.h>
@@ -23,21 +24,37 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
 #endif
 #include <string.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <sys/timeb.h>
 #include <json-c/json.h>
 #include <time.h>
 
 #include "list.h"
+#include "lib_sensor.h"
+#include "upload.h"
 
 #define __stringify_1(x)    #x
 #define __stringify(x)      __stringify_1(x)
 
 #define MAXLINE 256
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#ifndef _MSC_VER
+/* a Winsock socket is not a file descriptor */
+#define closesocket close
+#endif
+
 #ifdef _MSC_VER
+typedef SSIZE_T ssize_t;
 #define insane_free(ptr) { free(ptr); ptr = 0; }
 int vasprintf(char **strp, const char *fmt, va_list ap)
 {
@@ -70,60 +87,809 @@ int asprintf(char **strp, const char *fmt, ...)
 }
 #endif
 
-static int s_running = 1;
+/*
+ * Property handles, see lib_sensor_prop(). The names are registered for
+ * the whole process, every datapoint keeps the values of the registered
+ * props converted once whenever its props change, so drivers read them
+ * through the sample without any lookup. The registry is not per instance:
+ * all instances share the handles and the PROP_MAX limit, a handle taken
+ * for one is valid, and cached, in the datapoints of every other.
+ */
+#define PROP_MAX 64
+
+struct prop_value {
+	const char *s;
+	double d;
+	int i;
+};
+
+/*
+ * A read in flight keeps the cache it was started with: when the props of
+ * the datapoint change or it is deleted meanwhile, the cache is handed to
+ * the completion and freed once it is drained, see props_retire().
+ */
+struct lib_sensor_props {
+	json_object *node;	/* "props" of the datapoint, a reference is held */
+	int n;			/* handles below n are cached in v */
+	struct prop_value *v;
+	/* driver state of the datapoint, see lib_sensor_set_context() */
+	void *context;
+	void (*free_context)(void *);
+	int file_fd;		/* content of the file sample or -1, see lib_sensor_file_fd() */
+};
 
-json_object *datapoints, *config;
-const char *config_file;
-int fd;
+static const char *prop_names[PROP_MAX];
+static int prop_count;
+#ifndef _MSC_VER
+static pthread_mutex_t prop_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
-/* The list of intervals to collect data for each datapoint */
-LIST_HEAD(intervals);
+/*
+ * Runtime record of a datapoint. The records are kept in config order in
+ * 'dp_list' and, once they have an id, in 'dp_table' for lookup by id, so
+ * adding and deleting a datapoint costs O(1). The "datapoints" array of the
+ * config is only rebuilt from the list when the config is written back.
+ */
+struct datapoint {
+	struct list_head list;
+	json_object *obj;	/* {"id": ..., "props": {...}} as in the config */
+	int id;			/* 0 until registered */
+	int type;		/* enum lib_sensor_type of "dataType" */
+	long long rate;		/* "sampleRate" in ms */
+	const char *bus;	/* "bus" the datapoint is sampled on, may be NULL */
+	int nfields;		/* values in a vector, see pack_vector() */
+	int field_type;		/* index in field_types[] of "fieldType" */
+	int block_size;		/* "blockSize" of a waveform, see prepare_sample() */
+	int upload_prio;	/* enum upload_priority of "uploadPriority" of a file */
+	int upload_dedup;	/* "uploadDedup" of a file, see doFileTransfer() */
+	struct file_dedup *dedup;	/* the last file uploaded, NULL before the first */
+	int wave_rate;		/* "waveRate" of a waveform */
+	struct lib_sensor_block *blocks;	/* the two blocks of a waveform */
+	int block_next;		/* block the next sample is acquired in */
+	struct lib_sensor_props *cache;	/* props of the handles, see lib_sensor_prop() */
+	long long t;		/* last time data was collected */
+	unsigned int msg_seq;	/* data message the last sample went into */
+	/* read state of an asynchronous driver, NULL until the first read */
+	struct lib_sensor_completion *async;
+	/* active subscriptions on this datapoint, see handle_subscribe() */
+	struct list_head subs;
+};
 
-struct interval {
+/*
+ * A consumer (e.g. a dashboard behind the agent) asking for a datapoint
+ * to be sampled faster than its "sampleRate" for a while.
+ */
+struct subscription {
 	struct list_head list;
-	long long t;
+	char *consumer;
+	long long period;	/* in ms */
+	long long expires;	/* system time in ms, 0 means never */
+};
+
+/*
+ * Config write-back state. Changes only mark the config dirty, the main loop
+ * serializes it once "persistDelay" ms after the first change and hands the
+ * text to the persist thread, which writes it to a temp file, fsyncs it and
+ * renames it over the config file. Bursts of changes cost one write.
+ */
+#define DEFAULT_PERSIST_DELAY 1000
+
+/*
+ * Journaled persistence, enabled with "persistMode": "journal". Every set,
+ * add and del appends one delta record to "${config_file}.journal" instead
+ * of rewriting the whole config. Startup replays the journal onto the base
+ * config. After "journalCompact" records the main loop snapshots the config,
+ * moves the journal aside to "${config_file}.journal.old" and starts a new
+ * one, the persist thread writes the snapshot and then drops the old journal.
+ * Replaying a record twice is harmless, so a crash at any point of a
+ * compaction loses nothing.
+ */
+#define DEFAULT_JOURNAL_COMPACT 1000
+
+struct fd_watch {
+	int fd;				/* -1 once unwatched */
+	lib_sensor_fd_func_t *func;
+	void *arg;
 };
 
-struct upload_info {
-	char *host;
-	char *file;
-	char *url;
-	int port;
-	int retry;
+/*
+ * A sensor app instance, everything the library keeps lives here so any
+ * number of instances can run side by side on their own threads. The loop
+ * of an instance is single threaded, only the fields under 'persist_lock'
+ * and 'done_lock' are shared with other threads.
+ */
+struct lib_sensor {
+	volatile int running;
+	volatile int stopped;		/* see lib_sensor_stop() */
+	char *config_file;
+	json_object *config;
+	int fd;				/* connection to the agent */
+	int epfd;			/* every fd the loop waits for, see lib_sensor_get_fd() */
+
+	/* agent messages, see agent_send() and agent_recv() */
+	struct json_tokener *tokener;
+	char *in;
+	unsigned int in_len, in_size;
+	char *out;
+	size_t out_len, out_size, out_limit;
+
+	/* driver */
+	dp_data_func_t *get_data;	/* lib_sensor_start() only */
+	dp_sample_func_t *get_sample;
+	dp_batch_func_t *get_batch;
+	dp_start_read_func_t *start_read;
+	set_dp_func_t *set_dp;
+	void *data;
+
+	/* datapoint records, see struct datapoint */
+	struct list_head dp_list;
+	struct lh_table *dp_table;
+
+	/* config write-back and journal, see persist_tick() */
+	long long persist_delay;
+	int persisting;			/* the thread of persist_start() runs */
+	int persist_dirty;
+	long long persist_deadline;
+#ifndef _MSC_VER
+	pthread_t persist_thr;
+	pthread_mutex_t persist_lock;
+	pthread_cond_t persist_cond;
+	pthread_cond_t persist_idle;	/* the thread finished a snapshot or sync */
+	char *persist_pending;		/* snapshot waiting to be written */
+	int persist_sync_fd;		/* journal to be synced, owned by the thread */
+	int persist_compacting;		/* the pending snapshot is a compaction */
+	int persist_quit;
+#endif
+	int journal_fd;
+	int journal_records;
+	int journal_compact;
+	int journal_unsynced;
+	char *journal_file, *journal_old_file;
+
+	/* registration, see send_reg_chunk() */
+	struct list_head reg_chunks;
+	struct list_head *reg_next;	/* next datapoint to register */
+	int reg_chunk_size;
+	int reg_window;
+	int reg_refs;			/* refs handed out so far */
+	int reg_sent, reg_total;	/* chunks sent, chunks in total */
+
+	/* data message being built, see data_msg_add() */
+	char *data_msg;
+	size_t data_msg_size, data_msg_len;
+	int data_msg_count;
+	unsigned int data_msg_seq;
+	long long data_msg_t;
+	char *consumers;		/* see format_consumers() */
+	size_t consumers_size;
+
+	/* datapoints due in the current tick, see collect_datapoints() */
+	struct datapoint **due, **batch;
+	void **props;
+	struct lib_sensor_sample *samples;
+	int due_size;
+
+	/* asynchronous drivers and published samples, see handle_completions() */
+#ifndef _MSC_VER
+	struct list_head done_list;
+	pthread_mutex_t done_lock;
+	int wake_fds[2];
+	int published, publish_limit;
+#endif
+	struct fd_watch *watches;
+	int nwatches, watches_size;
+
+	/* files being uploaded, see doFileTransfer() */
+	struct upload_pool *uploads;
+
+	/* agent latency fed to the uploads, see data_msg_end() */
+	long long probe_id, probe_t;
+	int probe_timeout;		/* ms after which the answer counts as lost, 0 never */
+	int srtt;			/* ms, 0 until the agent answered a data message */
 };
 
+/* the instance of lib_sensor_start() and lib_sensor_start_ex() */
+static struct lib_sensor default_instance;
+
 long long get_system_time() {
 	struct timeb t;
 	ftime(&t);
 	return 1000 * (long long)t.time + t.millitm;
 }
 
+/*
+ * Registered for the whole process by lib_sensor_start(), so it can only
+ * stop the default instance, see lib_sensor_run_default().
+ */
 void sig_handler(int signo)
 {
 	printf("Received signal %d", signo);
-	s_running = 0;
+	default_instance.running = 0;
+}
+
+static struct datapoint *find_datapoint(struct lib_sensor *ls, int dpid);
+static struct datapoint *add_datapoint(struct lib_sensor *ls, json_object *obj);
+static void del_datapoint(struct lib_sensor *ls, struct datapoint *dp);
+static void update_datapoint_props(struct datapoint *dp);
+static void handle_data_response(struct lib_sensor *ls, json_object *jo);
+
+/*
+ * Mark the config as changed, it will be written back to the config file
+ * after the persist delay.
+ */
+static void config_changed(struct lib_sensor *ls)
+{
+	if (!ls->persist_dirty) {
+		ls->persist_dirty = 1;
+		ls->persist_deadline = get_system_time() + ls->persist_delay;
+	}
+}
+
+/*
+ * Rebuild the "datapoints" array of the config from the datapoint records.
+ */
+static void sync_datapoints(struct lib_sensor *ls)
+{
+	json_object *arr = json_object_new_array();
+	struct datapoint *dp;
+
+	list_for_each_entry(dp, &ls->dp_list, list)
+		json_object_array_add(arr, json_object_get(dp->obj));
+	json_object_object_add(ls->config, "datapoints", arr);
+}
+
+#ifndef _MSC_VER
+/*
+ * Replace 'file' with 'len' bytes of 'buf' so that a crash leaves either the
+ * old or the new content, never a truncated file.
+ */
+static int write_file_atomic(const char *file, const char *buf, size_t len)
+{
+	char *tmp = NULL, *dir = NULL;
+	int tfd, ret = -1;
+	ssize_t n;
+
+	if (asprintf(&tmp, "%s.tmp", file) < 0)
+		return -1;
+
+	tfd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (tfd < 0) {
+		fprintf(stderr, "open %s error: %s\n", tmp, strerror(errno));
+		goto out;
+	}
+	while (len > 0) {
+		n = write(tfd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "write %s error: %s\n", tmp, strerror(errno));
+			close(tfd);
+			goto out;
+		}
+		buf += n;
+		len -= n;
+	}
+	if (fsync(tfd) < 0 || close(tfd) < 0) {
+		fprintf(stderr, "sync %s error: %s\n", tmp, strerror(errno));
+		goto out;
+	}
+	if (rename(tmp, file) < 0) {
+		fprintf(stderr, "rename %s error: %s\n", tmp, strerror(errno));
+		goto out;
+	}
+
+	/* make the rename itself durable */
+	dir = strdup(file);
+	if (dir != NULL) {
+		tfd = open(dirname(dir), O_RDONLY);
+		if (tfd >= 0) {
+			fsync(tfd);
+			close(tfd);
+		}
+	}
+	ret = 0;
+out:
+	if (ret < 0)
+		unlink(tmp);
+	free(tmp);
+	free(dir);
+	return ret;
+}
+
+static void *persist_thread(void *arg)
+{
+	struct lib_sensor *ls = arg;
+	char *snapshot;
+	int sync_fd, compaction;
+
+	pthread_mutex_lock(&ls->persist_lock);
+	for (;;) {
+		while (ls->persist_pending == NULL && ls->persist_sync_fd < 0 && !ls->persist_quit)
+			pthread_cond_wait(&ls->persist_cond, &ls->persist_lock);
+		if (ls->persist_pending == NULL && ls->persist_sync_fd < 0)
+			break;
+		snapshot = ls->persist_pending;
+		ls->persist_pending = NULL;
+		compaction = ls->persist_compacting;
+		sync_fd = ls->persist_sync_fd;
+		ls->persist_sync_fd = -1;
+		pthread_mutex_unlock(&ls->persist_lock);
+
+		if (sync_fd >= 0) {
+			fdatasync(sync_fd);
+			close(sync_fd);
+		}
+		if (snapshot != NULL) {
+			/* keep the old journal if the base config could not be replaced */
+			if (write_file_atomic(ls->config_file, snapshot, strlen(snapshot)) == 0 && compaction)
+				unlink(ls->journal_old_file);
+			free(snapshot);
+		}
+
+		pthread_mutex_lock(&ls->persist_lock);
+		if (snapshot != NULL && compaction)
+			ls->persist_compacting = 0;
+		pthread_cond_broadcast(&ls->persist_idle);
+	}
+	pthread_mutex_unlock(&ls->persist_lock);
+	return NULL;
+}
+
+/*
+ * Apply one journal record to the loaded config. Records are idempotent:
+ * "add" replaces a datapoint with the same id, "set" and "del" of a missing
+ * datapoint do nothing.
+ */
+static void journal_replay_record(struct lib_sensor *ls, json_object *rec)
+{
+	const char *op = json_object_get_string(json_object_object_get(rec, "op"));
+	json_object *id = json_object_object_get(rec, "id");
+	json_object *props, *obj;
+	struct datapoint *dp;
+
+	if (op == NULL || id == NULL)
+		return;
+	dp = find_datapoint(ls, json_object_get_int(id));
+
+	if (strcmp(op, "set") == 0) {
+		const char *node = json_object_get_string(json_object_object_get(rec, "node"));
+		if (dp == NULL || node == NULL)
+			return;
+		props = json_object_object_get(dp->obj, "props");
+		if (json_object_object_get(props, node) != NULL) {
+			json_object_object_add(props, node, json_object_get(json_object_object_get(rec, "value")));
+			update_datapoint_props(dp);
+		}
+	} else if (strcmp(op, "add") == 0) {
+		if (dp != NULL) {
+			json_object_object_add(dp->obj, "props", json_object_get(json_object_object_get(rec, "props")));
+			update_datapoint_props(dp);
+		} else {
+			obj = json_object_new_object();
+			json_object_object_add(obj, "id", json_object_new_string(json_object_get_string(id)));
+			json_object_object_add(obj, "props", json_object_get(json_object_object_get(rec, "props")));
+			add_datapoint(ls, obj);
+			json_object_put(obj);
+		}
+	} else if (strcmp(op, "del") == 0) {
+		if (dp != NULL)
+			del_datapoint(ls, dp);
+	}
+}
+
+/*
+ * Replay a journal file onto the config, returns the number of records.
+ * A torn last line left by a crash is ignored.
+ */
+static int journal_replay(struct lib_sensor *ls, const char *file)
+{
+	FILE *fp = fopen(file, "r");
+	char *line = NULL;
+	size_t cap = 0;
+	json_object *rec;
+	int n = 0;
+
+	if (fp == NULL)
+		return 0;
+	while (getline(&line, &cap, fp) > 0) {
+		rec = json_tokener_parse(line);
+		if (rec == NULL)
+			continue;
+		journal_replay_record(ls, rec);
+		json_object_put(rec);
+		n++;
+	}
+	free(line);
+	fclose(fp);
+	return n;
+}
+
+/*
+ * Open the journal and bring the config up to date with it. Replayed
+ * records are folded into the base config right away so the journal starts
+ * empty.
+ */
+static int journal_open(struct lib_sensor *ls)
+{
+	json_object *jo = json_object_object_get(ls->config, "journalCompact");
+	int n;
+
+	if (jo != NULL && json_object_get_int(jo) > 0)
+		ls->journal_compact = json_object_get_int(jo);
+	if (asprintf(&ls->journal_file, "%s.journal", ls->config_file) < 0
+		|| asprintf(&ls->journal_old_file, "%s.journal.old", ls->config_file) < 0) {
+		printf("Out of memory!");
+		return -1;
+	}
+
+	n = journal_replay(ls, ls->journal_old_file) + journal_replay(ls, ls->journal_file);
+	if (n > 0) {
+		const char *snapshot;
+		sync_datapoints(ls);
+		snapshot = json_object_to_json_string_ext(ls->config, JSON_C_TO_STRING_PLAIN);
+		printf("replayed %d config journal records\n", n);
+		if (write_file_atomic(ls->config_file, snapshot, strlen(snapshot)) < 0)
+			return -1;
+		unlink(ls->journal_old_file);
+	}
+
+	ls->journal_fd = open(ls->journal_file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (ls->journal_fd < 0) {
+		fprintf(stderr, "open %s error: %s\n", ls->journal_file, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Move the current journal aside and start a new one, called with the
+ * snapshot that will make the old journal obsolete. On failure the journal
+ * is kept and appended to, the snapshot is still written but is no
+ * compaction, and the next try waits for another journalCompact records
+ * instead of coming with every change.
+ */
+static int journal_rotate(struct lib_sensor *ls)
+{
+	int nfd;
+
+	if (rename(ls->journal_file, ls->journal_old_file) < 0) {
+		fprintf(stderr, "rename %s error: %s\n", ls->journal_file, strerror(errno));
+		goto fail;
+	}
+	nfd = open(ls->journal_file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (nfd < 0) {
+		fprintf(stderr, "open %s error: %s\n", ls->journal_file, strerror(errno));
+		/* journal_fd still appends to it, it must not be removed as the old one */
+		if (rename(ls->journal_old_file, ls->journal_file) < 0)
+			fprintf(stderr, "rename %s error: %s\n", ls->journal_old_file, strerror(errno));
+		goto fail;
+	}
+	/* the persist thread syncs and closes the old journal */
+	ls->persist_sync_fd = ls->journal_fd;
+	ls->journal_fd = nfd;
+	ls->journal_records = 0;
+	ls->journal_unsynced = 0;
+	return 0;
+fail:
+	fprintf(stderr, "config journal not compacted, next try in %d records\n", ls->journal_compact);
+	ls->journal_records = 0;
+	return -1;
+}
+#endif
+
+/*
+ * Record a change of the config: append it to the journal in journal mode,
+ * otherwise schedule a write-back of the whole config.
+ */
+static void config_record(struct lib_sensor *ls, json_object *rec)
+{
+#ifndef _MSC_VER
+	if (ls->journal_fd >= 0) {
+		const char *line = json_object_to_json_string_ext(rec, JSON_C_TO_STRING_PLAIN);
+		char *buf = NULL;
+		int len = asprintf(&buf, "%s\n", line);
+		if (len < 0 || write(ls->journal_fd, buf, len) != len) {
+			fprintf(stderr, "append journal error: %s\n", strerror(errno));
+			config_changed(ls);
+		} else if (++ls->journal_records >= ls->journal_compact) {
+			config_changed(ls);
+		} else if (!ls->journal_unsynced) {
+			ls->journal_unsynced = 1;
+			ls->persist_deadline = get_system_time() + ls->persist_delay;
+		}
+		free(buf);
+		json_object_put(rec);
+		return;
+	}
+#endif
+	json_object_put(rec);
+	config_changed(ls);
+}
+
+/*
+ * Called from the main loop, hand a snapshot of the config to the persist
+ * thread once the persist delay is over. In journal mode a snapshot is a
+ * compaction, otherwise only the journal is synced. With 'force' the delay
+ * is ignored.
+ */
+static void persist_tick(struct lib_sensor *ls, long long now, int force)
+{
+#ifdef _MSC_VER
+	if (!ls->persist_dirty || (!force && now < ls->persist_deadline))
+		return;
+	ls->persist_dirty = 0;
+	sync_datapoints(ls);
+	json_object_to_file_ext(ls->config_file, ls->config, JSON_C_TO_STRING_PLAIN);
+#else
+	char *snapshot = NULL;
+
+	if (!(ls->persist_dirty || ls->journal_unsynced) || (!force && now < ls->persist_deadline))
+		return;
+
+	pthread_mutex_lock(&ls->persist_lock);
+	if (ls->persist_dirty && ls->journal_fd >= 0 && (ls->persist_compacting || ls->persist_sync_fd >= 0)) {
+		/* previous compaction still in flight, try again later */
+		pthread_mutex_unlock(&ls->persist_lock);
+		ls->persist_deadline = now + ls->persist_delay;
+		return;
+	}
+	pthread_mutex_unlock(&ls->persist_lock);
+
+	if (ls->persist_dirty) {
+		/* on the loop thread, so without indentation: less to format, copy and write */
+		sync_datapoints(ls);
+		snapshot = strdup(json_object_to_json_string_ext(ls->config, JSON_C_TO_STRING_PLAIN));
+		if (snapshot == NULL) {
+			printf("Out of memory!");
+			return;
+		}
+	}
+
+	pthread_mutex_lock(&ls->persist_lock);
+	if (snapshot != NULL) {
+		if (ls->journal_fd >= 0 && journal_rotate(ls) == 0)
+			ls->persist_compacting = 1;
+		/* a newer snapshot supersedes one that was not written yet */
+		free(ls->persist_pending);
+		ls->persist_pending = snapshot;
+	} else if (ls->persist_sync_fd < 0) {
+		ls->persist_sync_fd = dup(ls->journal_fd);
+		ls->journal_unsynced = 0;
+	}
+	ls->persist_dirty = 0;
+	pthread_cond_signal(&ls->persist_cond);
+	pthread_mutex_unlock(&ls->persist_lock);
+#endif
+}
+
+static int persist_start(struct lib_sensor *ls)
+{
+	json_object *jo = json_object_object_get(ls->config, "persistDelay");
+	if (jo != NULL)
+		ls->persist_delay = json_object_get_int64(jo);
+#ifndef _MSC_VER
+	jo = json_object_object_get(ls->config, "persistMode");
+	if (jo != NULL && strcmp(json_object_get_string(jo), "journal") == 0) {
+		if (journal_open(ls) < 0)
+			return -1;
+	}
+	ls->persist_quit = 0;
+	if (pthread_create(&ls->persist_thr, NULL, persist_thread, ls) != 0) {
+		printf("create persist thread failed");
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+/*
+ * Flush pending config changes and wait until they are on disk.
+ */
+static void persist_stop(struct lib_sensor *ls)
+{
+#ifndef _MSC_VER
+	/* wait for a compaction in flight before forcing out the last changes */
+	pthread_mutex_lock(&ls->persist_lock);
+	while (ls->persist_pending != NULL || ls->persist_sync_fd >= 0 || ls->persist_compacting)
+		pthread_cond_wait(&ls->persist_idle, &ls->persist_lock);
+	pthread_mutex_unlock(&ls->persist_lock);
+#endif
+	persist_tick(ls, 0, 1);
+#ifndef _MSC_VER
+	pthread_mutex_lock(&ls->persist_lock);
+	ls->persist_quit = 1;
+	pthread_cond_signal(&ls->persist_cond);
+	pthread_mutex_unlock(&ls->persist_lock);
+	pthread_join(ls->persist_thr, NULL);
+	if (ls->journal_fd >= 0) {
+		close(ls->journal_fd);
+		ls->journal_fd = -1;
+	}
+#endif
+}
+
+#define DEFAULT_UPLOAD_WORKERS 2
+#define DEFAULT_UPLOAD_QUEUE 16
+#define DEFAULT_UPLOAD_IDLE_TIMEOUT 30
+#define DEFAULT_DNS_TTL 300
+#define DEFAULT_UPLOAD_LATENCY_MAX 2000
+#define DEFAULT_UPLOAD_SPOOL_QUOTA (64LL << 20)
+
+/*
+ * The last file uploaded of a datapoint with "uploadDedup", shared by the
+ * datapoint and its uploads. Only a successful upload sets it, from the
+ * upload worker, see dedup_done().
+ */
+struct file_dedup {
+	int refs;
+	unsigned long long hash;
+	long long size;
+	char *file;		/* its name as sent to the agent, NULL if none */
+};
+
+/* upload_info.data of a file of such a datapoint */
+struct dedup_upload {
+	struct file_dedup *last;
+	unsigned long long hash;
+	long long size;		/* -1 if the file could not be hashed */
+	struct lib_sensor *ls;
+	int id;				/* of the datapoint */
+	struct lib_sensor_sample sample;	/* sent once the file is checked */
+};
+
+#ifndef _MSC_VER
+static int queue_sample(struct lib_sensor *ls, int dp_id, const struct lib_sensor_sample *sample, int checked);
+#endif
+
+#ifndef _MSC_VER
+static pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void dedup_put(struct file_dedup *last)
+{
+	int refs;
+
+#ifndef _MSC_VER
+	pthread_mutex_lock(&dedup_lock);
+#endif
+	refs = --last->refs;
+#ifndef _MSC_VER
+	pthread_mutex_unlock(&dedup_lock);
+#endif
+	if (refs > 0)
+		return;
+	free(last->file);
+	free(last);
 }
 
-static void *http_putfile(void *thread_param);
+#ifndef _MSC_VER
+static void dedup_done(struct upload_info *upinfo, int ret)
+{
+	struct dedup_upload *up = upinfo->data;
+	struct file_dedup *last = up->last;
+	char *file = ret == 0 ? strdup(up->sample.value.file) : NULL;
+
+	pthread_mutex_lock(&dedup_lock);
+	free(last->file);
+	last->file = file;
+	last->hash = up->hash;
+	last->size = up->size;
+	pthread_mutex_unlock(&dedup_lock);
+}
+
+static void dedup_free(void *data)
+{
+	struct dedup_upload *up = data;
+
+	dedup_put(up->last);
+	free(up);
+}
+
+/*
+ * upload_info.check of a file of a datapoint with "uploadDedup", so that
+ * the file is read by the upload worker rather than the loop: whether it
+ * has the same content as the last file of the datapoint uploaded. Its
+ * sample is sent to the agent then, with the name of the last file in
+ * place of its own if it is the same.
+ */
+static int dedup_check(struct upload_info *upinfo)
+{
+	struct dedup_upload *up = upinfo->data;
+	struct file_dedup *last = up->last;
+	int same = 0;
+
+	if (upload_hash(upinfo->file, upinfo->memfd, &up->hash, &up->size) < 0)
+		up->size = -1;
+	pthread_mutex_lock(&dedup_lock);
+	if (last->file != NULL && up->size >= 0 && up->hash == last->hash && up->size == last->size) {
+		printf("%s is the same as %s, not uploaded\n", up->sample.value.file, last->file);
+		snprintf(up->sample.value.file, sizeof(up->sample.value.file), "%s", last->file);
+		same = 1;
+	}
+	pthread_mutex_unlock(&dedup_lock);
+	if (queue_sample(up->ls, up->id, &up->sample, 1) < 0)
+		fprintf(stderr, "sample of %s dropped\n", up->sample.value.file);
+	return same;
+}
+
+/*
+ * Have the upload worker check a file of a datapoint with "uploadDedup"
+ * before it is uploaded, see dedup_check(). Returns -1 if it cannot.
+ */
+static int dedup_add(struct lib_sensor *ls, struct datapoint *dp, int id,
+	const struct lib_sensor_sample *sample, struct upload_info *upinfo)
+{
+	struct dedup_upload *up;
+
+	if (dp->dedup == NULL) {
+		dp->dedup = calloc(1, sizeof(*dp->dedup));
+		if (dp->dedup == NULL)
+			return -1;
+		dp->dedup->refs = 1;
+	}
+	up = calloc(1, sizeof(*up));
+	if (up == NULL)
+		return -1;
+	up->ls = ls;
+	up->id = id;
+	up->sample = *sample;
+	up->sample.props = NULL;
+	up->last = dp->dedup;
+	pthread_mutex_lock(&dedup_lock);
+	dp->dedup->refs++;
+	pthread_mutex_unlock(&dedup_lock);
+	upinfo->check = dedup_check;
+	upinfo->done = dedup_done;
+	upinfo->data = up;
+	upinfo->free_data = dedup_free;
+	return 0;
+}
+#endif
 
 /*
- * Schedule file transfer into a thread
+ * Queue the file of a sample for upload by the upload workers, see
+ * upload_submit(). Returns 0 if the name of the file can be sent to the
+ * agent, -1 if the file is dropped. The content is read from the memfd the
+ * driver gave with lib_sensor_file_fd() if any, the file is only its name
+ * then. With 'dedup' and "uploadDedup" returns 1, the sample is sent once
+ * the upload worker checked the file, see dedup_check().
  */
-static int doFileTransfer(int id, char *file)
+static int doFileTransfer(struct lib_sensor *ls, struct datapoint *dp, int id, struct lib_sensor_sample *sample, int dedup)
 {
-	int ret = 0;
-	struct upload_info *upinfo = malloc(sizeof(struct upload_info));
+	struct lib_sensor_props *props = (struct lib_sensor_props *)sample->props;
+	char *file = sample->value.file;
+	struct upload_info *upinfo;
+	int memfd = -1;
+
+	if (props != NULL) {
+		memfd = props->file_fd;
+		props->file_fd = -1;
+	}
+
+	upinfo = calloc(1, sizeof(struct upload_info));
+	if (upinfo == NULL) {
+		printf("Out of memory!");
+		if (memfd >= 0)
+			close(memfd);
+		return -1;
+	}
+	upinfo->memfd = memfd;
+#ifndef _MSC_VER
+	dedup = dedup && dp->upload_dedup && dedup_add(ls, dp, id, sample, upinfo) == 0;
+#else
+	dedup = 0;
+#endif
 	upinfo->file = strdup(file);
 
 	/* cloud server address */
-	json_object *jo = json_object_object_get(config, "cloudserveraddr");
+	json_object *jo = json_object_object_get(ls->config, "cloudserveraddr");
 	if (jo == NULL)
 		upinfo->host = strdup("cloud.easyiot.com.cn");
 	else
 		upinfo->host = strdup(json_object_get_string(jo));
 
 	/* cloud server port */
-	jo = json_object_object_get(config, "cloudserverport");
+	jo = json_object_object_get(ls->config, "cloudserverport");
 	if (jo == NULL)
 		upinfo->port = 80;
 	else
@@ -134,80 +900,720 @@ static int doFileTransfer(int id, char *file)
 	char * filename = strchr(file, '/');
 #endif
 	filename = filename ? filename + 1 : file;
-	jo = json_object_object_get(config, "api");
+	jo = json_object_object_get(ls->config, "api");
 	if (jo == NULL)
 		asprintf(&upinfo->url, "/api/file/%d/%s?apiKey=%s",
 		id,
 		filename,
-		json_object_get_string(json_object_object_get(config, "apikey"))
+		json_object_get_string(json_object_object_get(ls->config, "apikey"))
 		);
 	else
 		asprintf(&upinfo->url, "%s/%d/%s?apiKey=%s",
 		json_object_get_string(jo),
 		id,
 		filename,
-		json_object_get_string(json_object_object_get(config, "apikey"))
+		json_object_get_string(json_object_object_get(ls->config, "apikey"))
 		);
 
-	jo = json_object_object_get(config, "retry");
+	jo = json_object_object_get(ls->config, "retry");
 	if (jo == NULL)
 		upinfo->retry = 5;
 	else
 		upinfo->retry = json_object_get_int(jo);
 
+	upinfo->priority = dp->upload_prio;
+
+	/* off unless the server takes Content-Range uploads */
+	jo = json_object_object_get(ls->config, "uploadChunkSize");
+	if (jo != NULL)
+		upinfo->chunk_size = json_object_get_int64(jo);
+
 	if (upinfo->file == NULL || upinfo->host == NULL || upinfo->url == NULL) {
 		printf("Out of memory!");
-		ret = -1;
+		upload_info_free(upinfo);
+		return -1;
 	}
 
-#ifdef _MSC_VER
-       HANDLE thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)http_putfile, (void *)upinfo, 0, NULL);
-#else
-       pthread_t thr;
-       if (pthread_create(&thr, NULL, http_putfile, (void*)upinfo) != 0) {
-               printf("create upload thread failed");
-               ret = -1;
-       }
-#endif
-
-       return ret;
+	if (upload_submit(ls->uploads, upinfo) < 0)
+		return -1;
+	return dedup;
 }
 
 /*
- * Get datapoint data according to datapoint index
+ * Call a dp_data_func_t of lib_sensor_start like a dp_sample_func_t, the
+ * malloc'd result is copied into the sample and freed.
  */
-static void * get_datapoint_data_dummy(void *props)
+static int get_sample_legacy(dp_data_func_t *get_data, void *props, struct lib_sensor_sample *sample)
 {
-	return NULL;
+	void *data;
+
+	/* waveform blocks are provided by the library */
+	if (sample->type == LIB_SENSOR_WAVEFORM)
+		return -1;
+	data = get_data(props);
+	if (data == NULL)
+		return -1;
+	if (sample->type == LIB_SENSOR_NUMERIC) {
+		sample->value.numeric = *(double *)data;
+	} else if (sample->type == LIB_SENSOR_VECTOR) {
+		/* an array of as many doubles as the vector has fields */
+		memcpy(sample->value.vector.v, data, sample->value.vector.n * sizeof(double));
+	} else {
+		strncpy(sample->value.file, (char *)data, LIB_SENSOR_PATH_MAX - 1);
+		sample->value.file[LIB_SENSOR_PATH_MAX - 1] = '\0';
+	}
+	free(data);
+	return 0;
 }
 
-void * (*__get_datapoint_data)(void *) = get_datapoint_data_dummy;
+/*
+ * A read started on an asynchronous driver. One is allocated per datapoint
+ * on its first read and reused after, it is queued on 'done_list' by
+ * lib_sensor_complete() and handed back to the datapoint by the loop.
+ * lib_sensor_publish() queues a copy of its sample in one as well, with
+ * the datapoint id set instead of 'dp'.
+ */
+struct lib_sensor_completion {
+	struct list_head list;
+	struct lib_sensor *ls;
+	struct datapoint *dp;		/* NULL once the datapoint is deleted */
+	int id;				/* datapoint id of a published sample */
+	int in_flight;
+	int result;
+	struct lib_sensor_sample sample;	/* filled by the driver */
+	struct lib_sensor_sample last;		/* last completed sample */
+	int has_last;
+	void *blocks;			/* waveform blocks of a deleted datapoint */
+	struct lib_sensor_props *retired;	/* props cache of the driver, see props_retire() */
+	int checked;			/* a published file is uploaded already, see dedup_check() */
+};
 
-static void add_interval() {
-	/* add data collect time stamp for new datapoint */
-	long long t = get_system_time();
-	struct interval *inter = malloc(sizeof(struct interval));
-	memset(inter, 0, sizeof(*inter));
-	inter->t = t;
-	list_add_tail((struct list_head *)inter, &intervals);
-}
+/*
+ * Vector datapoints sample several values at once, e.g. the three axes of
+ * an accelerometer. "fields" names the values, separated by commas, and
+ * "fieldType" gives how each is encoded. The values are sent as one record
+ * of packed little-endian fields, base64 encoded in "data".
+ */
+static const struct {
+	const char *name;
+	int size;
+} field_types[] = {
+	{ "float", 4 },		/* the default */
+	{ "double", 8 },
+	{ "int16", 2 },
+	{ "int32", 4 },
+};
 
-static void remove_interval(int i) {
-	/* remove data collect time stamp for new datapoint */
-	long long t = get_system_time();
-	struct interval *inter = malloc(sizeof(struct interval));
-	memset(inter, 0, sizeof(*inter));
-	inter->t = t;
-	list_add_tail((struct list_head *)inter, &intervals);
+static int parse_vector_props(struct datapoint *dp, json_object *props)
+{
+	const char *fields = json_object_get_string(json_object_object_get(props, "fields"));
+	const char *type = json_object_get_string(json_object_object_get(props, "fieldType"));
+	int i;
+
+	if (fields == NULL || *fields == '\0')
+		return LIB_SENSOR_UNKNOWN;
+	for (dp->nfields = 1; *fields != '\0'; fields++) {
+		if (*fields == ',')
+			dp->nfields++;
+	}
+	if (dp->nfields > LIB_SENSOR_VECTOR_MAX) {
+		printf("vector with more than %d fields\n", LIB_SENSOR_VECTOR_MAX);
+		return LIB_SENSOR_UNKNOWN;
+	}
+	dp->field_type = 0;
+	for (i = 0; type != NULL && i < sizeof(field_types) / sizeof(field_types[0]); i++) {
+		if (strcmp(type, field_types[i].name) == 0)
+			dp->field_type = i;
+	}
+	return LIB_SENSOR_VECTOR;
 }
 
-void handle_message(json_object *req, json_object *res)
+/*
+ * Base64 encode 'len' bytes, 'out' must hold BASE64_LEN(len) + 1 bytes.
+ */
+#define BASE64_LEN(len) (4 * (((len) + 2) / 3))
+
+static void base64_encode(const unsigned char *in, int len, char *out)
+{
+	static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	unsigned int u;
+	int i;
+
+	for (i = 0; i < len; i += 3) {
+		u = in[i] << 16;
+		if (i + 1 < len)
+			u |= in[i + 1] << 8;
+		if (i + 2 < len)
+			u |= in[i + 2];
+		*out++ = b64[(u >> 18) & 0x3f];
+		*out++ = b64[(u >> 12) & 0x3f];
+		*out++ = i + 1 < len ? b64[(u >> 6) & 0x3f] : '=';
+		*out++ = i + 2 < len ? b64[u & 0x3f] : '=';
+	}
+	*out = '\0';
+}
+
+/*
+ * Values of a waveform block the driver filled in.
+ */
+static int block_count(const struct lib_sensor_block *block)
+{
+	return block->n < 0 ? 0 : block->n > block->size ? block->size : block->n;
+}
+
+/*
+ * Base64 encode the values of a waveform block little-endian, 'out' must
+ * hold BASE64_LEN(2 * block_count(block)) + 1 bytes. The block is left in
+ * host order, it is the last sample of an asynchronous read until the next.
+ */
+static void block_base64(const struct lib_sensor_block *block, char *out)
+{
+	static const union { short s; char c; } host = { 1 };
+	unsigned char le[96];	/* a multiple of 3, no padding in between */
+	int i, j, k, n = block_count(block);
+
+	if (host.c) {
+		base64_encode((const unsigned char *)block->data, n * 2, out);
+		return;
+	}
+	*out = '\0';
+	for (i = 0; i < n; i += k) {
+		k = n - i < (int)sizeof(le) / 2 ? n - i : (int)sizeof(le) / 2;
+		for (j = 0; j < k; j++) {
+			le[2 * j] = block->data[i + j] & 0xff;
+			le[2 * j + 1] = (block->data[i + j] >> 8) & 0xff;
+		}
+		base64_encode(le, k * 2, out);
+		out += BASE64_LEN(k * 2);
+	}
+}
+
+/*
+ * Encode the values of a vector sample, 'out' must hold VECTOR_B64_MAX bytes.
+ */
+#define VECTOR_B64_MAX (BASE64_LEN(LIB_SENSOR_VECTOR_MAX * 8) + 1)
+
+static void pack_vector(const struct datapoint *dp, const struct lib_sensor_sample *sample, char *out)
+{
+	unsigned char rec[LIB_SENSOR_VECTOR_MAX * 8], *p = rec;
+	unsigned long long u;
+	unsigned int u32;
+	double v;
+	float f;
+	int i, j, len;
+
+	for (i = 0; i < dp->nfields; i++) {
+		v = sample->value.vector.v[i];
+		switch (dp->field_type) {
+		case 0:
+			f = (float)v;
+			memcpy(&u32, &f, 4);
+			u = u32;
+			break;
+		case 1:
+			memcpy(&u, &v, 8);
+			break;
+		default:
+			/* round and saturate to the integer type */
+			len = 8 * field_types[dp->field_type].size - 1;
+			if (v >= (double)(1LL << len))
+				v = (double)((1LL << len) - 1);
+			else if (v < -(double)(1LL << len))
+				v = -(double)(1LL << len);
+			u = (unsigned long long)(long long)(v < 0 ? v - 0.5 : v + 0.5);
+			break;
+		}
+		for (j = 0; j < field_types[dp->field_type].size; j++)
+			*p++ = (u >> (8 * j)) & 0xff;
+	}
+	base64_encode(rec, p - rec, out);
+}
+
+/*
+ * Waveform datapoints stream blocks of int16 samples acquired at a high
+ * rate, e.g. an ADC channel at some kHz. The library owns two blocks of
+ * "blockSize" samples per datapoint and hands them to the driver in turn,
+ * so an asynchronous driver acquires the next block while the last one is
+ * sent. Blocks are encoded straight from the driver's buffer into the data
+ * message, see data_msg_add().
+ */
+#define DEFAULT_BLOCK_SIZE 4096
+
+static struct lib_sensor_props *props_new(void)
+{
+	struct lib_sensor_props *cache = calloc(1, sizeof(*cache));
+
+	if (cache == NULL) {
+		printf("Out of memory!");
+		return NULL;
+	}
+	cache->file_fd = -1;
+	return cache;
+}
+
+static void props_free(struct lib_sensor_props *cache)
+{
+	if (cache == NULL)
+		return;
+	if (cache->free_context != NULL)
+		cache->free_context(cache->context);
+	if (cache->file_fd >= 0)
+		close(cache->file_fd);
+	json_object_put(cache->node);
+	free(cache->v);
+	free(cache);
+}
+
+/*
+ * Whether the driver of a read in flight was given the props cache of the
+ * datapoint, it must not be changed or freed until the read completes.
+ */
+static int props_in_use(struct datapoint *dp)
+{
+	return dp->async != NULL && dp->async->in_flight && dp->async->sample.props == dp->cache;
+}
+
+/*
+ * Hand the props cache of the datapoint to the read in flight that uses
+ * it, handle_completions() frees it. Returns 0 if no read uses it.
+ */
+static int props_retire(struct datapoint *dp)
+{
+	if (!props_in_use(dp))
+		return 0;
+	dp->async->retired = dp->cache;
+	dp->cache = NULL;
+	return 1;
+}
+
+/*
+ * Parse the props the scheduler needs on every sample, called whenever
+ * the props of a datapoint change.
+ */
+static void update_datapoint_props(struct datapoint *dp) {
+	json_object *props = json_object_object_get(dp->obj, "props");
+	const char *datatype = json_object_get_string(json_object_object_get(props, "dataType"));
+	struct lib_sensor_props *cache;
+	struct prop_value *v;
+	json_object *jo;
+	int i, n;
+
+	if (datatype != NULL && strcmp(datatype, "numeric") == 0)
+		dp->type = LIB_SENSOR_NUMERIC;
+	else if (datatype != NULL && strcmp(datatype, "file") == 0)
+		dp->type = LIB_SENSOR_FILE;
+	else if (datatype != NULL && strcmp(datatype, "vector") == 0)
+		dp->type = parse_vector_props(dp, props);
+	else if (datatype != NULL && strcmp(datatype, "waveform") == 0)
+		dp->type = LIB_SENSOR_WAVEFORM;
+	else
+		dp->type = LIB_SENSOR_UNKNOWN;
+	dp->rate = 1000LL * json_object_get_int(json_object_object_get(props, "sampleRate"));
+	dp->bus = json_object_get_string(json_object_object_get(props, "bus"));
+	if (dp->type == LIB_SENSOR_WAVEFORM) {
+		dp->block_size = json_object_get_int(json_object_object_get(props, "blockSize"));
+		if (dp->block_size <= 0)
+			dp->block_size = DEFAULT_BLOCK_SIZE;
+		dp->wave_rate = json_object_get_int(json_object_object_get(props, "waveRate"));
+	}
+	if (dp->type == LIB_SENSOR_FILE) {
+		const char *prio = json_object_get_string(json_object_object_get(props, "uploadPriority"));
+		const char *dedup = json_object_get_string(json_object_object_get(props, "uploadDedup"));
+
+		if (prio != NULL && strcmp(prio, "high") == 0)
+			dp->upload_prio = UPLOAD_PRIO_HIGH;
+		else if (prio != NULL && strcmp(prio, "low") == 0)
+			dp->upload_prio = UPLOAD_PRIO_LOW;
+		else
+			dp->upload_prio = UPLOAD_PRIO_NORMAL;
+		dp->upload_dedup = dedup != NULL && (strcmp(dedup, "true") == 0 || atoi(dedup) != 0);
+	}
+
+	/* the driver state was derived from the old props */
+	if (props_in_use(dp)) {
+		cache = props_new();
+		if (cache == NULL)
+			return;
+		props_retire(dp);
+		dp->cache = cache;
+	} else {
+		if (dp->cache->free_context != NULL)
+			dp->cache->free_context(dp->cache->context);
+		dp->cache->context = NULL;
+		dp->cache->free_context = NULL;
+	}
+
+	/* convert the props drivers asked handles for */
+#ifndef _MSC_VER
+	pthread_mutex_lock(&prop_lock);
+#endif
+	n = prop_count;
+#ifndef _MSC_VER
+	pthread_mutex_unlock(&prop_lock);
+#endif
+	cache = dp->cache;
+	json_object_put(cache->node);
+	cache->node = json_object_get(props);
+	if (n > cache->n) {
+		v = realloc(cache->v, n * sizeof(*v));
+		if (v == NULL)
+			n = cache->n;
+		else
+			cache->v = v;
+	}
+	for (i = 0; i < n; i++) {
+		jo = json_object_object_get(props, prop_names[i]);
+		cache->v[i].s = json_object_get_string(jo);
+		cache->v[i].d = json_object_get_double(jo);
+		cache->v[i].i = json_object_get_int(jo);
+	}
+	cache->n = n;
+}
+
+/*
+ * Fill in what the library knows of a sample before the driver gets it.
+ */
+static int prepare_sample(struct datapoint *dp, struct lib_sensor_sample *sample, long long t)
+{
+	struct lib_sensor_block *block;
+	int i;
+
+	sample->type = dp->type;
+	sample->status = LIB_SENSOR_OK;
+	sample->timestamp = t;
+	sample->props = dp->cache;
+	/* left by a sample that failed */
+	if (dp->cache->file_fd >= 0) {
+		close(dp->cache->file_fd);
+		dp->cache->file_fd = -1;
+	}
+	if (dp->type == LIB_SENSOR_VECTOR) {
+		sample->value.vector.n = dp->nfields;
+	} else if (dp->type == LIB_SENSOR_WAVEFORM) {
+		/* no read is in flight here, the blocks can be reallocated */
+		if (dp->blocks == NULL || dp->blocks[0].size != dp->block_size) {
+			/* the last sample kept for getData is in the old blocks */
+			if (dp->async != NULL)
+				dp->async->has_last = 0;
+			free(dp->blocks);
+			dp->blocks = malloc(2 * (sizeof(*block) + dp->block_size * sizeof(short)));
+			if (dp->blocks == NULL) {
+				printf("Out of memory!");
+				return -1;
+			}
+			for (i = 0; i < 2; i++) {
+				dp->blocks[i].size = dp->block_size;
+				dp->blocks[i].data = (short *)(dp->blocks + 2) + i * dp->block_size;
+			}
+		}
+		block = &dp->blocks[dp->block_next];
+		dp->block_next ^= 1;
+		block->rate = dp->wave_rate;
+		block->n = 0;
+		sample->value.waveform = block;
+	}
+	return 0;
+}
+
+/*
+ * Collect one sample of a datapoint, returns 0 if the driver provided one.
+ */
+static int sample_datapoint(struct lib_sensor *ls, struct datapoint *dp, struct lib_sensor_sample *sample, long long now) {
+	void *props;
+	int ret;
+
+	if (dp->type == LIB_SENSOR_UNKNOWN)
+		return -1;
+	if (ls->start_read != NULL) {
+		/* reads complete later, answer with the last one as it was sent */
+		if (dp->async == NULL || !dp->async->has_last)
+			return -1;
+		*sample = dp->async->last;
+		return 0;
+	}
+	if (prepare_sample(dp, sample, now) < 0)
+		return -1;
+	props = json_object_object_get(dp->obj, "props");
+	if (ls->get_batch != NULL && dp->bus != NULL)
+		ret = ls->get_batch(&props, 1, sample);
+	else if (ls->get_data != NULL)
+		ret = get_sample_legacy(ls->get_data, props, sample);
+	else if (ls->get_sample != NULL)
+		ret = ls->get_sample(props, sample);
+	else
+		ret = -1;
+	if (ret == 0 && sample->status == LIB_SENSOR_FAILED)
+		ret = -1;
+	return ret;
+}
+
+/*
+ * Format at offset 'off' of a buffer that grows as needed and is reused
+ * between calls, so that the sampling path does not allocate once the
+ * buffer is big enough. Returns the length of the formatted string or -1.
+ */
+static int buf_printf(char **buf, size_t *size, size_t off, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+	char *p;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(*buf + off, *size > off ? *size - off : 0, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			return -1;
+		if (off + n < *size)
+			return n;
+		p = realloc(*buf, 2 * (off + n + 1));
+		if (p == NULL)
+			return -1;
+		*buf = p;
+		*size = 2 * (off + n + 1);
+	}
+}
+
+/*
+ * Create the runtime record of a datapoint object and append it to the
+ * datapoint list, a datapoint with an id already managed is replaced.
+ */
+static struct datapoint *add_datapoint(struct lib_sensor *ls, json_object *obj) {
+	json_object *id = json_object_object_get(obj, "id");
+	struct datapoint *dp;
+
+	if (id != NULL && (dp = find_datapoint(ls, atoi(json_object_get_string(id)))) != NULL) {
+		json_object_object_add(dp->obj, "props", json_object_get(json_object_object_get(obj, "props")));
+		update_datapoint_props(dp);
+		return dp;
+	}
+
+	dp = malloc(sizeof(struct datapoint));
+	if (dp == NULL) {
+		printf("Out of memory!");
+		return NULL;
+	}
+	memset(dp, 0, sizeof(*dp));
+	dp->cache = props_new();
+	if (dp->cache == NULL) {
+		free(dp);
+		return NULL;
+	}
+	dp->obj = json_object_get(obj);
+	/* add data collect time stamp for new datapoint */
+	dp->t = get_system_time();
+	INIT_LIST_HEAD(&dp->subs);
+	update_datapoint_props(dp);
+	list_add_tail(&dp->list, &ls->dp_list);
+	if (id != NULL) {
+		dp->id = atoi(json_object_get_string(id));
+		lh_table_insert(ls->dp_table, (void *)(long)dp->id, dp);
+	}
+	return dp;
+}
+
+/*
+ * Assign the id the agent allocated to a newly registered datapoint.
+ */
+static void set_datapoint_id(struct lib_sensor *ls, struct datapoint *dp, json_object *id) {
+	json_object_object_add(dp->obj, "id", json_object_get(id));
+	if (dp->id != 0)
+		lh_table_delete(ls->dp_table, (void *)(long)dp->id);
+	dp->id = atoi(json_object_get_string(id));
+	lh_table_insert(ls->dp_table, (void *)(long)dp->id, dp);
+}
+
+static struct datapoint *find_datapoint(struct lib_sensor *ls, int dpid) {
+	void *dp;
+
+	if (dpid != 0 && lh_table_lookup_ex(ls->dp_table, (void *)(long)dpid, &dp))
+		return (struct datapoint *)dp;
+	return NULL;
+}
+
+static void free_subscription(struct subscription *sub) {
+	list_del(&sub->list);
+	free(sub->consumer);
+	free(sub);
+}
+
+/*
+ * Get the effective sample period of a datapoint in ms: the fastest of its
+ * own "sampleRate" and every subscription that has not expired yet. Expired
+ * subscriptions are dropped on the way.
+ */
+static long long effective_period(struct datapoint *dp, long long now) {
+	struct subscription *sub, *tmp;
+	long long period = dp->rate;
+
+	list_for_each_entry_safe(sub, tmp, &dp->subs, list) {
+		if (sub->expires != 0 && now >= sub->expires) {
+			printf("subscription of %s expired\n", sub->consumer);
+			free_subscription(sub);
+			continue;
+		}
+		if (sub->period < period)
+			period = sub->period;
+	}
+	return period;
+}
+
+/*
+ * Format the ", \"consumers\": [...]" member of a data message for the
+ * active subscriptions of a datapoint, an empty string if there is none.
+ * The returned string is valid until the next call.
+ */
+static const char *format_consumers(struct lib_sensor *ls, struct datapoint *dp) {
+	struct subscription *sub;
+	const char *sep = "";
+	char *p;
+	size_t len = 0;
+
+	if (list_head_is_empty(&dp->subs))
+		return "";
+
+	list_for_each_entry(sub, &dp->subs, list)
+		len += strlen(sub->consumer) + 4;
+	if (len + 20 > ls->consumers_size) {
+		p = realloc(ls->consumers, len + 20);
+		if (p == NULL)
+			return "";
+		ls->consumers = p;
+		ls->consumers_size = len + 20;
+	}
+	p = ls->consumers + sprintf(ls->consumers, ", \"consumers\": [");
+	list_for_each_entry(sub, &dp->subs, list) {
+		p += sprintf(p, "%s\"%s\"", sep, sub->consumer);
+		sep = ", ";
+	}
+	strcpy(p, "]");
+	return ls->consumers;
+}
+
+/*
+ * Remove a datapoint and its schedule state.
+ */
+static void del_datapoint(struct lib_sensor *ls, struct datapoint *dp) {
+	struct subscription *sub, *tmp;
+
+	list_for_each_entry_safe(sub, tmp, &dp->subs, list)
+		free_subscription(sub);
+	/* a read still in flight is freed when it completes */
+	if (dp->async != NULL) {
+		if (dp->async->in_flight) {
+			/* the driver may still use its props and write to a waveform block */
+			props_retire(dp);
+			dp->async->dp = NULL;
+			dp->async->blocks = dp->blocks;
+			dp->blocks = NULL;
+		} else {
+			free(dp->async);
+		}
+	}
+	if (dp->id != 0)
+		lh_table_delete(ls->dp_table, (void *)(long)dp->id);
+	/* registration may still have to go through the rest of the list */
+	if (ls->reg_next == &dp->list)
+		ls->reg_next = dp->list.next;
+	list_del(&dp->list);
+	json_object_put(dp->obj);
+	props_free(dp->cache);
+	free(dp->blocks);
+	if (dp->dedup != NULL)
+		dedup_put(dp->dedup);
+	free(dp);
+}
+
+/*
+ * Handle "subscribe" and "unsubscribe" requests.
+ * Message format:
+ * {
+ *   "method": "subscribe",
+ *   "params": {"id": ${datapoint_id}, "consumer": "${consumer}",
+ *              "rate": ${seconds}, "duration": ${seconds}},
+ *   "id": ${msgid}
+ * }
+ * {
+ *   "method": "unsubscribe",
+ *   "params": {"id": ${datapoint_id}, "consumer": "${consumer}"},
+ *   "id": ${msgid}
+ * }
+ * "rate" is at least SUBSCRIBE_PERIOD_MIN ms. "duration" is optional, a
+ * subscription without it or with a duration of 0 stays until the consumer
+ * unsubscribes. Subscribing again with the same consumer updates the
+ * existing subscription.
+ * Response format:
+ * {
+ *   "result": true/false,
+ *   "id": ${msgid}
+ * }
+ */
+#define SUBSCRIBE_PERIOD_MIN 10
+
+static void handle_subscribe(struct lib_sensor *ls, json_object *params, json_object *res, int subscribe) {
+	struct subscription *sub, *found = NULL;
+	const char *consumer = json_object_get_string(json_object_object_get(params, "consumer"));
+	struct datapoint *dp = find_datapoint(ls, json_object_get_int(json_object_object_get(params, "id")));
+
+	if (dp == NULL || consumer == NULL) {
+		json_object_object_add(res, "result", json_object_new_boolean(FALSE));
+		json_object_object_add(res, "error", json_object_new_string("ID not found!"));
+		return;
+	}
+	/* consumers are copied verbatim into data messages */
+	if (strpbrk(consumer, "\"\\\b\f\n\r\t") != NULL) {
+		json_object_object_add(res, "result", json_object_new_boolean(FALSE));
+		json_object_object_add(res, "error", json_object_new_string("Invalid consumer."));
+		return;
+	}
+
+	list_for_each_entry(sub, &dp->subs, list) {
+		if (strcmp(sub->consumer, consumer) == 0) {
+			found = sub;
+			break;
+		}
+	}
+
+	if (!subscribe) {
+		if (found != NULL)
+			free_subscription(found);
+		json_object_object_add(res, "result", json_object_new_boolean(found != NULL));
+		return;
+	}
+
+	double rate = json_object_get_double(json_object_object_get(params, "rate"));
+	double duration = json_object_get_double(json_object_object_get(params, "duration"));
+	/* a period that rounds down to nothing would sample in a busy loop */
+	if (!(rate * 1000 >= SUBSCRIBE_PERIOD_MIN)) {
+		json_object_object_add(res, "result", json_object_new_boolean(FALSE));
+		json_object_object_add(res, "error", json_object_new_string("Invalid rate."));
+		return;
+	}
+	if (!(duration >= 0)) {
+		json_object_object_add(res, "result", json_object_new_boolean(FALSE));
+		json_object_object_add(res, "error", json_object_new_string("Invalid duration."));
+		return;
+	}
+
+	if (found == NULL) {
+		found = malloc(sizeof(struct subscription));
+		memset(found, 0, sizeof(*found));
+		found->consumer = strdup(consumer);
+		list_add_tail(&found->list, &dp->subs);
+	}
+	found->period = (long long)(rate * 1000);
+	found->expires = duration > 0 ? get_system_time() + (long long)(duration * 1000) : 0;
+	json_object_object_add(res, "result", json_object_new_boolean(TRUE));
+}
+
+void handle_message(struct lib_sensor *ls, json_object *req, json_object *res)
 {
 	/* New Request from agent */
 	json_object *method = json_object_object_get(req, "method");
 	json_object *params = json_object_object_get(req, "params");
-	json_object *idx, *jo, *val;
-	int i, n, dpid;
+	json_object *jo, *val, *rec = NULL;
+	struct datapoint *dp;
+	int dpid;
 	const char *msg;
 
 	if (method == NULL || params == NULL) {
@@ -216,7 +1622,11 @@ void handle_message(json_object *req, json_object *res)
 		return;
 	}
 
-	if (strcmp(json_object_get_string(method), "set") == 0) {
+	if (strcmp(json_object_get_string(method), "subscribe") == 0) {
+		handle_subscribe(ls, params, res, 1);
+	} else if (strcmp(json_object_get_string(method), "unsubscribe") == 0) {
+		handle_subscribe(ls, params, res, 0);
+	} else if (strcmp(json_object_get_string(method), "set") == 0) {
 		/*
 		 * Set a parameter of a datapoint.
 		 * Message format:
@@ -234,22 +1644,28 @@ void handle_message(json_object *req, json_object *res)
 		int found = 0;
 		/* which datapoint to operate by id */
 		dpid = json_object_get_int(json_object_object_get(params, "id"));
-		n = json_object_array_length(datapoints);
-		for (i = 0; i < n; i++) {
-			idx = json_object_array_get_idx(datapoints, i);
-			if (atoi(json_object_get_string(json_object_object_get(idx, "id"))) == dpid)
-				break;
-		}
-		if (i < n) {
+		dp = find_datapoint(ls, dpid);
+		if (dp != NULL) {
 			/* found datapoint id, try to find node */
 			msg = json_object_get_string(json_object_object_get(params, "node"));
-			jo = json_object_object_get(idx, "props");
+			jo = json_object_object_get(dp->obj, "props");
 			if (jo != NULL) {
 				val = json_object_object_get(jo, msg);
 				if (val != NULL) {
+					/* a read in flight still uses the props, change a copy */
+					if (props_in_use(dp) && (val = json_tokener_parse(json_object_to_json_string(jo))) != NULL) {
+						json_object_object_add(dp->obj, "props", val);
+						jo = val;
+					}
 					/* node found, set value */
 					json_object_object_add(jo, msg, json_object_get(json_object_object_get(params, "value")));
+					update_datapoint_props(dp);
 					found = 1;
+					rec = json_object_new_object();
+					json_object_object_add(rec, "op", json_object_new_string("set"));
+					json_object_object_add(rec, "id", json_object_get(json_object_object_get(dp->obj, "id")));
+					json_object_object_add(rec, "node", json_object_new_string(msg));
+					json_object_object_add(rec, "value", json_object_get(json_object_object_get(params, "value")));
 				}
 			}
 		}
@@ -258,9 +1674,9 @@ void handle_message(json_object *req, json_object *res)
 			 * return the "props" field of the datapoint to let the agent update
 			 * the database and the in memory tree
 			 */
-			json_object_object_add(res, "result", json_object_get(json_object_object_get(idx, "props")));
+			json_object_object_add(res, "result", json_object_get(json_object_object_get(dp->obj, "props")));
 			/* write config back to config file */
-			json_object_to_file_ext(config_file, config, JSON_C_TO_STRING_PRETTY);
+			config_record(ls, rec);
 		} else {
 			/* Config path not found, send response */
 			json_object_object_add(res, "result", json_object_new_boolean(FALSE));
@@ -279,39 +1695,57 @@ void handle_message(json_object *req, json_object *res)
 		 *   "result": ${data}/false,
 		 *   "id": ${msgid}
 		 * }
+		 * ${data} is {"date": ..., "data": ...} as in a data message, with
+		 * the "rate" of the block for a waveform.
 		 */
 
 		dpid = atoi(json_object_get_string(params));
 
 		// Try to find id from local managed tree
-		n = json_object_array_length(datapoints);
-		for (i = 0; i < n; i++) {
-			idx = json_object_array_get_idx(datapoints, i);
-			if (atoi(json_object_get_string(json_object_object_get(idx, "id"))) == dpid) break;
-		}
+		dp = find_datapoint(ls, dpid);
 
 		// See if found
-		if (i < n) {
+		if (dp != NULL) {
 			json_object *data_obj = NULL;
 			json_object *result_obj = NULL;
-			const char *datatype = json_object_get_string(json_object_object_get(idx, "dataType"));
-			void *data = __get_datapoint_data(json_object_object_get(idx, "props"));
-			if (data != NULL) {
-				if (strcmp(datatype, "numeric") == 0) {
-					data_obj = json_object_new_double(*(double*)data);
-				} else if (strcmp(datatype, "file") == 0) {
-					if (doFileTransfer(dpid, (char*)data) == 0) {
-						data_obj = json_object_new_string((const char*)data);
+			struct lib_sensor_sample sample;
+			if (sample_datapoint(ls, dp, &sample, get_system_time()) == 0) {
+				if (sample.type == LIB_SENSOR_NUMERIC) {
+					data_obj = json_object_new_double(sample.value.numeric);
+				} else if (sample.type == LIB_SENSOR_VECTOR) {
+					char packed[VECTOR_B64_MAX];
+
+					pack_vector(dp, &sample, packed);
+					data_obj = json_object_new_string(packed);
+				} else if (sample.type == LIB_SENSOR_FILE) {
+					/*
+					 * the last sample of an asynchronous driver is uploaded already,
+					 * the answer cannot wait for the check of "uploadDedup"
+					 */
+					if (ls->start_read != NULL || doFileTransfer(ls, dp, dpid, &sample, 0) == 0) {
+						data_obj = json_object_new_string(sample.value.file);
 					} else {
 						fprintf(stderr, "Upload file to server failed.\n");
 					}
+				} else if (sample.type == LIB_SENSOR_WAVEFORM) {
+					/* the block as in the data message, see data_msg_add_block() */
+					char *b64 = malloc(BASE64_LEN(2 * block_count(sample.value.waveform)) + 1);
+
+					if (b64 != NULL) {
+						block_base64(sample.value.waveform, b64);
+						data_obj = json_object_new_string(b64);
+						free(b64);
+					}
 				}
-				free(data);
 			}
 			if (data_obj != NULL) {
 				result_obj = json_object_new_object();
-				json_object_object_add(result_obj, "date", json_object_new_int64(get_system_time()));
+				json_object_object_add(result_obj, "date", json_object_new_int64(sample.timestamp));
+				if (sample.type == LIB_SENSOR_WAVEFORM)
+					json_object_object_add(result_obj, "rate", json_object_new_int(sample.value.waveform->rate));
 				json_object_object_add(result_obj, "data", data_obj);
+				if (sample.status != LIB_SENSOR_OK)
+					json_object_object_add(result_obj, "status", json_object_new_int(sample.status));
 				json_object_object_add(res, "result", result_obj);
 			} else {
 				json_object_object_add(res, "result", json_object_new_boolean(FALSE));
@@ -340,16 +1774,20 @@ void handle_message(json_object *req, json_object *res)
 		 *   "id": ${msgid}
 		 * }
 		 */
-		struct lh_table *dp_table = json_object_get_object(params);
+		struct lh_table *new_table = json_object_get_object(params);
 		struct lh_entry *dp_entry;
-		lh_foreach(dp_table, dp_entry) {
-			add_interval();
+		lh_foreach(new_table, dp_entry) {
 			json_object *newdp = json_object_new_object();
 			json_object_object_add(newdp, "id", json_object_new_string((char*)dp_entry->k));
 			json_object_object_add(newdp, "props", json_object_get((struct json_object *)dp_entry->v));
-			json_object_array_add(datapoints, json_object_get(newdp));
+			add_datapoint(ls, newdp);
+			json_object_put(newdp);
+			rec = json_object_new_object();
+			json_object_object_add(rec, "op", json_object_new_string("add"));
+			json_object_object_add(rec, "id", json_object_new_string((char*)dp_entry->k));
+			json_object_object_add(rec, "props", json_object_get((struct json_object *)dp_entry->v));
+			config_record(ls, rec);
 		}
-		json_object_to_file_ext(config_file, config, JSON_C_TO_STRING_PRETTY);
 		json_object_object_add(res, "result", json_object_new_boolean(TRUE));
 	} else if (strcmp(json_object_get_string(method), "del") == 0) {
 		/*
@@ -370,24 +1808,16 @@ void handle_message(json_object *req, json_object *res)
 		dpid = atoi(json_object_get_string(params));
 
 		// Try to find id from local managed tree
-		n = json_object_array_length(datapoints);
-		json_object *new_dps = json_object_new_array();
-		int found = -1;
-		for (i = 0; i < n; i++) {
-			idx = json_object_array_get_idx(datapoints, i);
-			if (atoi(json_object_get_string(json_object_object_get(idx, "id"))) == dpid)
-				found = i;
-			else
-				json_object_array_add(new_dps, json_object_get(idx));
-		}
+		dp = find_datapoint(ls, dpid);
 
 		// See if found
-		if (found >= 0) {
-			remove_interval(found);
+		if (dp != NULL) {
+			del_datapoint(ls, dp);
 			json_object_object_add(res, "result", json_object_new_boolean(TRUE));
-			json_object_object_add(config, "datapoints", new_dps);
-			datapoints = new_dps;
-			json_object_to_file_ext(config_file, config, JSON_C_TO_STRING_PRETTY);
+			rec = json_object_new_object();
+			json_object_object_add(rec, "op", json_object_new_string("del"));
+			json_object_object_add(rec, "id", json_object_new_int(dpid));
+			config_record(ls, rec);
 		} else {
 			json_object_object_add(res, "result", json_object_new_boolean(FALSE));
 			json_object_object_add(res, "error", json_object_new_string("ID not found!"));
@@ -399,144 +1829,877 @@ void handle_message(json_object *req, json_object *res)
 }
 
 /*
- * Register datapoints to the agent
+ * Send a message to the agent. The agent socket is non-blocking, what it
+ * does not take right away is kept in the output queue and sent when the
+ * socket becomes writable, so a slow agent never blocks the loop or the
+ * host loop driving it. Up to "outQueueMax" bytes are queued, messages
+ * that do not fit are dropped.
+ */
+#define DEFAULT_OUT_QUEUE (4 << 20)
+static void agent_want_write(struct lib_sensor *ls, int on)
+{
+#ifndef _MSC_VER
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | (on ? EPOLLOUT : 0);
+	ev.data.fd = ls->fd;
+	epoll_ctl(ls->epfd, EPOLL_CTL_MOD, ls->fd, &ev);
+#endif
+}
+
+static int agent_send(struct lib_sensor *ls, const char *buf, size_t len)
+{
+	ssize_t n = 0;
+	char *p;
+
+	if (ls->out_len == 0) {
+		n = send(ls->fd, buf, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				perror("write socket error!");
+				ls->running = 0;
+				return -1;
+			}
+			n = 0;
+		}
+		if ((size_t)n == len)
+			return 0;
+		buf += n;
+		len -= n;
+	}
+
+	if (ls->out_len + len > ls->out_limit) {
+		printf("agent output queue full, message dropped\n");
+		return -1;
+	}
+	if (ls->out_len + len > ls->out_size) {
+		p = realloc(ls->out, 2 * (ls->out_len + len));
+		if (p == NULL) {
+			printf("Out of memory!");
+			return -1;
+		}
+		ls->out = p;
+		ls->out_size = 2 * (ls->out_len + len);
+	}
+	if (ls->out_len == 0)
+		agent_want_write(ls, 1);
+	memcpy(ls->out + ls->out_len, buf, len);
+	ls->out_len += len;
+	return 0;
+}
+
+/*
+ * Send what the output queue holds, called when the agent socket is writable.
+ */
+static void agent_flush(struct lib_sensor *ls)
+{
+	ssize_t n;
+
+	n = send(ls->fd, ls->out, ls->out_len, MSG_NOSIGNAL);
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			perror("write socket error!");
+			ls->running = 0;
+		}
+		return;
+	}
+	memmove(ls->out, ls->out + n, ls->out_len - n);
+	ls->out_len -= n;
+	if (ls->out_len == 0)
+		agent_want_write(ls, 0);
+}
+
+/*
+ * Registration is split into chunks of at most "regChunkSize" datapoints,
+ * up to "regWindow" chunks are in flight at the same time and the next one
+ * is sent as soon as a response comes back. Each chunk remembers its new
+ * datapoints, which can not be deleted by the agent before they have an
+ * id, so ids in the response are assigned to the right datapoints whatever
+ * happens to the datapoint list meanwhile.
+ */
+#define DEFAULT_REG_CHUNK_SIZE	256
+#define DEFAULT_REG_WINDOW	4
+
+struct reg_chunk {
+	struct list_head list;
+	int msgid;
+	int n;			/* number of new datapoints */
+	int *refs;		/* correlation refs of the new datapoints */
+	struct datapoint **dps;	/* the new datapoints */
+};
+
+/*
+ * Register the next chunk of datapoints to the agent
  * Message format:
  * {
  *   "method": "reg",
  *   "params": {
- *      "Name": "${appname}",
+ *      "appName": "${appname}",
  *   	"New": [${new_datapoint_profile_1},
  *   		${new_datapoint_profile_2},
  *   		..,
  *   		${new_datapoint_profile_N}],
+ *   	"Refs": [${new_datapoint_ref_1},
+ *   		..,
+ *   		${new_datapoint_ref_N}],
  *   	"Managed": [${managed_datapoint_id_1},
  *   		${managed_datapoint_id_2},
  *   		..,
- *   		${managed_datapoint_id_N}]
+ *   		${managed_datapoint_id_N}],
+ *   	"chunk": ${chunk_number},
+ *   	"chunks": ${total_chunks}
  *   },
  *   "id": ${msgid}
  * }
+ * The response carries the ids of the new datapoints, either as
+ * [{"ref": ${ref}, "id": ${id}}, ...] or, from older agents, as a plain
+ * array of ids in the order of "New".
  */
-void registerdatapoints(int msgid) {
+static int send_reg_chunk(struct lib_sensor *ls) {
 	json_object *new_field = json_object_new_array();
+	json_object *refs_field = json_object_new_array();
 	json_object *managed_field = json_object_new_array();
-
-	int i = 0;
-	int dp_num = json_object_array_length(datapoints);
-	json_object *idx, *val;
-	for (i = 0; i < dp_num; i++) {
-		idx = json_object_array_get_idx(datapoints, i);
-
-		add_interval();
-
-		val = json_object_object_get(idx, "id");
+	json_object *val, *reg_msg;
+	struct reg_chunk *chunk;
+	struct datapoint *dp;
+	int i;
+
+	chunk = malloc(sizeof(struct reg_chunk));
+	memset(chunk, 0, sizeof(*chunk));
+	chunk->msgid = ++ls->reg_sent;
+	chunk->refs = malloc(sizeof(int) * ls->reg_chunk_size);
+	chunk->dps = malloc(sizeof(struct datapoint *) * ls->reg_chunk_size);
+
+	for (i = 0; i < ls->reg_chunk_size && ls->reg_next != &ls->dp_list; i++) {
+		dp = list_entry(ls->reg_next, struct datapoint, list);
+		ls->reg_next = ls->reg_next->next;
+		val = json_object_object_get(dp->obj, "id");
 		if (val == NULL) {
-			json_object_array_add(new_field, json_object_get(json_object_object_get(idx, "props")));
+			json_object_array_add(new_field, json_object_get(json_object_object_get(dp->obj, "props")));
+			json_object_array_add(refs_field, json_object_new_int(ls->reg_refs));
+			chunk->refs[chunk->n] = ls->reg_refs++;
+			chunk->dps[chunk->n++] = dp;
 		} else {
 			json_object_array_add(managed_field, json_object_get(val));
 		}
 	}
+	list_add_tail(&chunk->list, &ls->reg_chunks);
 
 	int bytes;
-	json_object *reg_msg = json_object_new_object();
+	reg_msg = json_object_new_object();
 	val = json_object_new_object();
 
 	json_object_object_add(reg_msg, "method", json_object_new_string("reg"));
-	json_object_object_add(reg_msg, "id", json_object_new_int(msgid));
+	json_object_object_add(reg_msg, "id", json_object_new_int(chunk->msgid));
 	if (json_object_array_length(new_field) != 0) {
 		json_object_object_add(val, "New", new_field);
+		json_object_object_add(val, "Refs", refs_field);
+	} else {
+		json_object_put(new_field);
+		json_object_put(refs_field);
 	}
 	if (json_object_array_length(managed_field) != 0) {
 		json_object_object_add(val, "Managed", managed_field);
+	} else {
+		json_object_put(managed_field);
 	}
-	json_object_object_add(val, "appName", json_object_get(json_object_object_get(config, "appName")));
+	json_object_object_add(val, "appName", json_object_get(json_object_object_get(ls->config, "appName")));
+	json_object_object_add(val, "chunk", json_object_new_int(chunk->msgid));
+	json_object_object_add(val, "chunks", json_object_new_int(ls->reg_total));
 	json_object_object_add(reg_msg, "params", val);
 	const char *msg = json_object_get_string(reg_msg);
-	if ((bytes = send(fd, msg, strlen(msg), 0)) < 0) {
-		printf("write socket error:%s\n", strerror(errno));
-		close(fd);
-		exit(-1);
-	}
+	bytes = agent_send(ls, msg, strlen(msg));
 	json_object_put(reg_msg);
+	return bytes;
 }
 
-int lib_sensor_start(const char *cfg_file,
-	void *(*get_datapoint_data_func)(void *),
-	void(*set_datapoint_func)(void *, void *),
-	void *data
-	)
-{
-	int ret;
-	printf("lib_sensor-%s is initializing ...\n", __stringify(VERSION));
-#ifdef _MSC_VER
+/*
+ * Keep the registration window full.
+ */
+static void registerdatapoints(struct lib_sensor *ls) {
+	struct list_head *pos;
+	int inflight = 0;
+
+	list_for_each(pos, &ls->reg_chunks)
+		inflight++;
+	while ((ls->reg_next != &ls->dp_list || ls->reg_sent == 0) && inflight++ < ls->reg_window) {
+		if (send_reg_chunk(ls) < 0)
+			break;
+	}
+}
 
-	WORD wVersionRequested;
-	WSADATA wsaData;
-	int err;
+static void free_reg_chunk(struct reg_chunk *chunk) {
+	list_del(&chunk->list);
+	free(chunk->dps);
+	free(chunk->refs);
+	free(chunk);
+}
 
-	wVersionRequested = MAKEWORD(2, 2);
+/*
+ * Handle a response to a reg message, returns 0 if 'msgid' does not belong
+ * to a registration chunk.
+ */
+static int handle_reg_response(struct lib_sensor *ls, int msgid, json_object *val) {
+	struct reg_chunk *chunk, *found = NULL;
+	json_object *idx, *ref;
+	int i, j, n;
+
+	list_for_each_entry(chunk, &ls->reg_chunks, list) {
+		if (chunk->msgid == msgid) {
+			found = chunk;
+			break;
+		}
+	}
+	if (found == NULL)
+		return 0;
+
+	if (json_object_get_type(val) == json_type_boolean) {
+		json_bool r = json_object_get_boolean(val);
+		if (r == 0) {
+			/* this means there is
+			   { "result": false }
+			   in returned msg */
+			printf("Register sensor to dmagent failed.\n");
+			printf(" Please try to remove the \"id: ...\" line "
+			       "from sensor-app.json then rerun sensor "
+			       "application again.\n");
+			ls->running = 0;
+			free_reg_chunk(found);
+			return 1;
+		}
+	}
 
-	err = WSAStartup(wVersionRequested, &wsaData);
-	if (err != 0) {
-		printf("WSAStartup failed witherror: %d\n", err);
-		return 1;
+	/* reg new datapoints success ..
+	 * If the result is an array of ids, update local config file.
+	 */
+	if (json_object_get_type(val) == json_type_array) {
+		n = json_object_array_length(val);
+		for (i = 0; i < n; i++) {
+			idx = json_object_array_get_idx(val, i);
+			if (json_object_get_type(idx) == json_type_object) {
+				ref = json_object_object_get(idx, "ref");
+				for (j = 0; j < found->n; j++) {
+					if (found->refs[j] == json_object_get_int(ref))
+						break;
+				}
+				idx = json_object_object_get(idx, "id");
+			} else {
+				j = i;
+			}
+			if (j < found->n && idx != NULL)
+				set_datapoint_id(ls, found->dps[j], idx);
+		}
+		/* write config back to config file */
+		config_changed(ls);
 	}
-#endif
-	if (cfg_file == NULL || get_datapoint_data_func == NULL) {
-		printf("lib_sensor: wrong parameters.\n");
+
+	free_reg_chunk(found);
+	registerdatapoints(ls);
+	return 1;
+}
+
+/*
+ * Handle one complete message from the agent.
+ */
+static void handle_agent_message(struct lib_sensor *ls, json_object *jo)
+{
+	json_object *val, *res;
+
+	/*
+	 * Message could be operation result or new request.
+	 */
+	val = json_object_object_get(jo, "error");
+	if (val == NULL) {
+		val = json_object_object_get(jo, "result");
+		if (val != NULL) {
+			/* Response */
+			if (!handle_reg_response(ls, json_object_get_int(json_object_object_get(jo, "id")), val))
+				handle_data_response(ls, jo);
+		} else {
+			/* New Request */
+			res = json_object_new_object();
+			handle_message(ls, jo, res);
+
+			/* Send request processed result back */
+			const char *sendbuf = json_object_get_string(res);
+			agent_send(ls, sendbuf, strlen(sendbuf));
+			json_object_put(res);
+		}
+	} else {
+		printf("Message failed! Result:%s", json_object_get_string(val));
+		handle_data_response(ls, jo);
+	}
+}
+
+/*
+ * Read what the agent sent and handle every complete message in it.
+ */
+static void agent_recv(struct lib_sensor *ls)
+{
+	json_object *jo;
+	char *msg;
+	int bytes, start;
+
+	/* data available, append it to the buffer */
+	if (ls->in_len == ls->in_size) {
+		msg = realloc(ls->in, ls->in_size ? ls->in_size * 2 : 1024);
+		if (msg == NULL) {
+			printf("Out of memory when allocating buffer!");
+			ls->running = 0;
+			return;
+		}
+		ls->in = msg;
+		ls->in_size = ls->in_size ? ls->in_size * 2 : 1024;
+	}
+	bytes = recv(ls->fd, ls->in + ls->in_len, ls->in_size - ls->in_len, 0);
+	if (bytes < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			perror("read");
+			ls->running = 0;
+		}
+		return;
+	} else if (bytes == 0) {
+		printf("agent closed the connection.\n");
+		ls->running = 0;
+		return;
+	}
+	ls->in_len += bytes;
+
+	/*
+	 * The buffer may hold several messages and the beginning of
+	 * another one, handle the complete ones and keep the rest.
+	 */
+	start = 0;
+	while (start < ls->in_len) {
+		enum json_tokener_error jerr;
+
+		if (ls->in[start] == ' ' || ls->in[start] == '\t'
+			|| ls->in[start] == '\r' || ls->in[start] == '\n') {
+			start++;
+			continue;
+		}
+		json_tokener_reset(ls->tokener);
+		jo = json_tokener_parse_ex(ls->tokener, ls->in + start, ls->in_len - start);
+		jerr = json_tokener_get_error(ls->tokener);
+		if (jerr == json_tokener_continue)
+			break;
+		if (jo == NULL) {
+			printf("Bad message: %s\n", json_tokener_error_desc(jerr));
+			start = ls->in_len;
+			break;
+		}
+		printf("message received:%.*s\n", ls->tokener->char_offset, ls->in + start);
+		start += ls->tokener->char_offset;
+
+		handle_agent_message(ls, jo);
+		/* Message process finished */
+		json_object_put(jo);
+	}
+	memmove(ls->in, ls->in + start, ls->in_len - start);
+	ls->in_len -= start;
+}
+
+/*
+ * Send datapoint data to the agent
+ * Message format:
+ * {
+ *   "method": "data",
+ *   "params": {
+ *     "${datapoint_id}": {
+ *       "date": ${date},
+ *       "data":"${data}",
+ *       "status": ${status},
+ *       "consumers": ["${consumer}", ...]
+ *     },
+ *     ...
+ *   },
+ *   "id":${msgid}
+ * }
+ * All samples collected in one scheduler tick go out in one message. A
+ * datapoint can only be in a message once, a second sample of it, e.g. a
+ * burst of published ones, starts the next message.
+ * "status" is only present if it is not LIB_SENSOR_OK. "consumers" is only
+ * present while the datapoint has active subscriptions, one sample is read
+ * and sent for all of them and the agent fans it out.
+ * Here we just use strings instead of json_object to send out the message.
+ */
+static void data_msg_begin(struct lib_sensor *ls, long long t);
+static void data_msg_end(struct lib_sensor *ls);
+
+/*
+ * Add a waveform block to the data message, returns the length added or -1.
+ */
+static int data_msg_add_block(struct lib_sensor *ls, struct datapoint *dp, const char *id,
+	struct lib_sensor_sample *sample, const char *status)
+{
+	struct lib_sensor_block *block = sample->value.waveform;
+	size_t off = ls->data_msg_len;
+	int n = block_count(block), len;
+	char *p;
+
+	len = buf_printf(&ls->data_msg, &ls->data_msg_size, off, "%s\"%s\": {\"date\":%lld, \"rate\":%d, \"data\":\"",
+		ls->data_msg_count ? ", " : "", id, sample->timestamp, block->rate);
+	if (len < 0)
+		return -1;
+	off += len;
+	if (off + BASE64_LEN(n * 2) + 1 > ls->data_msg_size) {
+		p = realloc(ls->data_msg, 2 * (off + BASE64_LEN(n * 2) + 1));
+		if (p == NULL)
+			return -1;
+		ls->data_msg = p;
+		ls->data_msg_size = 2 * (off + BASE64_LEN(n * 2) + 1);
+	}
+	block_base64(block, ls->data_msg + off);
+	off += BASE64_LEN(n * 2);
+	len = buf_printf(&ls->data_msg, &ls->data_msg_size, off, "\"%s%s}", status, format_consumers(ls, dp));
+	if (len < 0)
 		return -1;
+	return off + len - ls->data_msg_len;
+}
+
+/*
+ * Add a sample to the data message, the file of a file sample is queued for
+ * upload unless 'checked' by dedup_check() already. Returns 1 if the sample
+ * is sent later, when the file is checked.
+ */
+static int data_msg_add(struct lib_sensor *ls, struct datapoint *dp, struct lib_sensor_sample *sample, int checked)
+{
+	const char *id = json_object_get_string(json_object_object_get(dp->obj, "id"));
+	char status[16] = "";
+	int len = -1, ret = 0;
+
+	if (sample->status == LIB_SENSOR_FAILED)
+		return 0;
+	if (dp->msg_seq == ls->data_msg_seq && ls->data_msg_count > 0) {
+		data_msg_end(ls);
+		data_msg_begin(ls, ls->data_msg_t);
+	}
+	if (sample->status != LIB_SENSOR_OK)
+		snprintf(status, sizeof(status), ", \"status\":%d", sample->status);
+
+	if (sample->type == LIB_SENSOR_NUMERIC) {
+		len = buf_printf(&ls->data_msg, &ls->data_msg_size, ls->data_msg_len, "%s\"%s\": {\"date\":%lld, \"data\":\"%lf\"%s%s}",
+			ls->data_msg_count ? ", " : "", id, sample->timestamp, sample->value.numeric, status, format_consumers(ls, dp));
+	} else if (sample->type == LIB_SENSOR_VECTOR) {
+		char packed[VECTOR_B64_MAX];
+
+		pack_vector(dp, sample, packed);
+		len = buf_printf(&ls->data_msg, &ls->data_msg_size, ls->data_msg_len, "%s\"%s\": {\"date\":%lld, \"data\":\"%s\"%s%s}",
+			ls->data_msg_count ? ", " : "", id, sample->timestamp, packed, status, format_consumers(ls, dp));
+	} else if (sample->type == LIB_SENSOR_WAVEFORM) {
+		len = data_msg_add_block(ls, dp, id, sample, status);
+	} else if (sample->type == LIB_SENSOR_FILE) {
+		if (!checked)
+			ret = doFileTransfer(ls, dp, atoi(id), sample, 1);
+		if (ret == 0) {
+			len = buf_printf(&ls->data_msg, &ls->data_msg_size, ls->data_msg_len, "%s\"%s\": {\"date\":%lld, \"data\":\"%s\"%s%s}",
+				ls->data_msg_count ? ", " : "", id, sample->timestamp, sample->value.file, status, format_consumers(ls, dp));
+		} else if (ret < 0) {
+			fprintf(stderr, "upload file to server failed.\n");
+		}
 	}
+	if (len > 0) {
+		ls->data_msg_len += len;
+		ls->data_msg_count++;
+		dp->msg_seq = ls->data_msg_seq;
+	}
+	return ret > 0;
+}
+
+static void data_msg_begin(struct lib_sensor *ls, long long t)
+{
+	ls->data_msg_seq++;
+	ls->data_msg_t = t;
+	ls->data_msg_count = 0;
+	ls->data_msg_len = 0;
+	ls->data_msg_len = buf_printf(&ls->data_msg, &ls->data_msg_size, 0, "{\"method\": \"data\", \"params\":{");
+}
 
-	config_file = cfg_file;
+static void data_msg_end(struct lib_sensor *ls)
+{
+	long long now;
+	int len;
+
+	if (ls->data_msg_count == 0)
+		return;
+	len = buf_printf(&ls->data_msg, &ls->data_msg_size, ls->data_msg_len, "}, \"id\":%lld}", ls->data_msg_t);
+	if (len < 0)
+		return;
+	ls->data_msg_len += len;
+	printf("sending server data msg: %s\n", ls->data_msg);
+	agent_send(ls, ls->data_msg, ls->data_msg_len);
 
 	/*
-	 *      Note, the 'set_datapoint_func' is optional, designed for futher extension
+	 * Time one data message at a time until the agent answers it, the
+	 * smoothed latency throttles file uploads sharing the link. A message
+	 * still unanswered counts with its age once the agent has answered one,
+	 * agents that never answer data messages never throttle. A lost answer
+	 * would keep that age growing, so after twice uploadLatencyMax the next
+	 * message is timed instead and the throttle can come down again.
 	 */
-	__get_datapoint_data = get_datapoint_data_func;
+	now = get_system_time();
+	if (ls->probe_id != 0 && ls->probe_timeout > 0 && now - ls->probe_t > ls->probe_timeout)
+		ls->probe_id = 0;
+	if (ls->probe_id == 0) {
+		ls->probe_id = ls->data_msg_t;
+		ls->probe_t = now;
+	} else if (ls->srtt > 0 && now - ls->probe_t > ls->srtt) {
+		upload_report_latency(ls->uploads, now - ls->probe_t);
+	}
+}
 
-	struct json_tokener *Json_tokener = json_tokener_new();
-	if (!Json_tokener) {
+static void handle_data_response(struct lib_sensor *ls, json_object *jo)
+{
+	int rtt;
+
+	if (ls->probe_id == 0 || json_object_get_int64(json_object_object_get(jo, "id")) != ls->probe_id)
+		return;
+	rtt = get_system_time() - ls->probe_t;
+	ls->srtt = ls->srtt > 0 ? (7 * ls->srtt + rtt) / 8 : (rtt > 0 ? rtt : 1);
+	ls->probe_id = 0;
+	upload_report_latency(ls->uploads, ls->srtt);
+}
+
+/*
+ * Asynchronous drivers. The driver starts a read and returns, it completes
+ * it later with lib_sensor_complete(), from any thread. Completed reads are
+ * queued on 'done_list' and the loop is woken through 'wake_fds', so the
+ * samples are sent from the loop thread like the synchronous ones. Drivers
+ * that wait for their own fds can have the loop watch them instead of
+ * running a thread, see lib_sensor_watch_fd(). Samples of event driven
+ * datapoints published with lib_sensor_publish() take the same way, at
+ * most 'publish_limit' of them are queued at a time.
+ */
+#define DEFAULT_PUBLISH_QUEUE 1024
+
+static void start_datapoint_read(struct lib_sensor *ls, struct datapoint *dp, long long t)
+{
+	struct lib_sensor_completion *c = dp->async;
+
+	if (c == NULL) {
+		c = calloc(1, sizeof(*c));
+		if (c == NULL) {
+			printf("Out of memory!");
+			return;
+		}
+		c->ls = ls;
+		c->dp = dp;
+		dp->async = c;
+	}
+	/* a slow device does not get a second read before the first is done */
+	if (c->in_flight)
+		return;
+	if (prepare_sample(dp, &c->sample, t) < 0)
+		return;
+	c->in_flight = 1;
+	if (ls->start_read(json_object_object_get(dp->obj, "props"), c) != 0)
+		c->in_flight = 0;
+}
+
+/*
+ * Send the samples of the reads completed and the samples published since
+ * the last call.
+ */
+static void handle_completions(struct lib_sensor *ls)
+{
+#ifndef _MSC_VER
+	LIST_HEAD(done);
+	struct lib_sensor_completion *c, *tmp;
+	struct datapoint *dp;
+	char drain[64];
+
+	while (read(ls->wake_fds[0], drain, sizeof(drain)) > 0)
+		;
+	pthread_mutex_lock(&ls->done_lock);
+	list_splice_init(&ls->done_list, &done);
+	ls->published = 0;
+	pthread_mutex_unlock(&ls->done_lock);
+
+	data_msg_begin(ls, get_system_time());
+	list_for_each_entry_safe(c, tmp, &done, list) {
+		list_del(&c->list);
+		if (c->id != 0) {
+			dp = find_datapoint(ls, c->id);
+			if (dp == NULL)
+				printf("published sample of unknown datapoint %d dropped\n", c->id);
+			else if (c->sample.type != dp->type)
+				printf("published sample of datapoint %d has wrong type\n", c->id);
+			else if (data_msg_add(ls, dp, &c->sample, c->checked) == 0 && c->checked && dp->async != NULL
+				&& (!dp->async->has_last || dp->async->last.timestamp <= c->sample.timestamp)) {
+				/* the read held back for the check, see below */
+				dp->async->last = c->sample;
+				dp->async->has_last = 1;
+			}
+			free(c);
+			continue;
+		}
+		c->in_flight = 0;
+		if (c->dp == NULL) {
+			props_free(c->retired);
+			free(c->blocks);
+			free(c);
+			continue;
+		}
+		/* after the upload, a file is kept under the name sent */
+		if (c->result == 0 && c->sample.status != LIB_SENSOR_FAILED
+			&& data_msg_add(ls, c->dp, &c->sample, 0) == 0) {
+			c->last = c->sample;
+			c->last.props = NULL;
+			c->has_last = 1;
+		}
+		props_free(c->retired);
+		c->retired = NULL;
+	}
+	data_msg_end(ls);
+#endif
+}
+
+/*
+ * Call the handler of a watched fd that is ready. Handlers may watch and
+ * unwatch fds, unwatched slots are only reclaimed by compact_watches().
+ */
+static void handle_watch(struct lib_sensor *ls, int wfd)
+{
+	int i;
+
+	for (i = 0; i < ls->nwatches; i++) {
+		if (ls->watches[i].fd == wfd) {
+			ls->watches[i].func(wfd, ls->watches[i].arg);
+			return;
+		}
+	}
+}
+
+static void compact_watches(struct lib_sensor *ls)
+{
+	int i, j;
+
+	for (i = j = 0; i < ls->nwatches; i++) {
+		if (ls->watches[i].fd >= 0)
+			ls->watches[j++] = ls->watches[i];
+	}
+	ls->nwatches = j;
+}
+
+/*
+ * Collect the data of every datapoint that is due. Datapoints with the same
+ * "bus" prop are handed to the batch function in one call if there is one,
+ * the others are sampled one by one.
+ */
+static void collect_datapoints(struct lib_sensor *ls, long long t)
+{
+	struct datapoint *dp;
+	int i, j, n = 0, nb, size;
+
+	list_for_each_entry(dp, &ls->dp_list, list) {
+		/* check if it is time to collect datapoint data */
+		if (t - dp->t <= effective_period(dp, t) || dp->type == LIB_SENSOR_UNKNOWN)
+			continue;
+		if (ls->start_read != NULL) {
+			dp->t = t;
+			start_datapoint_read(ls, dp, t);
+			continue;
+		}
+		if (n == ls->due_size) {
+			size = ls->due_size ? 2 * ls->due_size : 16;
+			if ((ls->due = realloc(ls->due, size * sizeof(*ls->due))) == NULL ||
+			    (ls->batch = realloc(ls->batch, size * sizeof(*ls->batch))) == NULL ||
+			    (ls->props = realloc(ls->props, size * sizeof(*ls->props))) == NULL ||
+			    (ls->samples = realloc(ls->samples, size * sizeof(*ls->samples))) == NULL) {
+				printf("Out of memory!");
+				exit(-1);
+			}
+			ls->due_size = size;
+		}
+		ls->due[n++] = dp;
+		dp->t = t;
+	}
+	if (n == 0)
+		return;
+
+	srand(time(NULL));
+	data_msg_begin(ls, t);
+	for (i = 0; i < n; i++) {
+		if (ls->due[i] == NULL)
+			continue;
+		if (ls->get_batch == NULL || ls->due[i]->bus == NULL) {
+			if (sample_datapoint(ls, ls->due[i], &ls->samples[0], t) == 0)
+				data_msg_add(ls, ls->due[i], &ls->samples[0], 0);
+			continue;
+		}
+
+		/* take the rest of the datapoints due on the same bus along */
+		nb = 0;
+		for (j = i; j < n; j++) {
+			if (ls->due[j] == NULL || ls->due[j]->bus == NULL || strcmp(ls->due[j]->bus, ls->due[i]->bus) != 0)
+				continue;
+			if (prepare_sample(ls->due[j], &ls->samples[nb], t) == 0) {
+				ls->batch[nb] = ls->due[j];
+				ls->props[nb] = json_object_object_get(ls->due[j]->obj, "props");
+				nb++;
+			}
+			if (j != i)
+				ls->due[j] = NULL;
+		}
+		if (nb > 0 && ls->get_batch(ls->props, nb, ls->samples) == 0) {
+			for (j = 0; j < nb; j++)
+				data_msg_add(ls, ls->batch[j], &ls->samples[j], 0);
+		}
+	}
+	data_msg_end(ls);
+}
+
+/*
+ * Set up an instance, the config is only loaded when it runs.
+ */
+static int lib_sensor_init(struct lib_sensor *ls, const char *cfg_file,
+	dp_sample_func_t *get_sample_func, set_dp_func_t *set_datapoint_func, void *data)
+{
+	memset(ls, 0, sizeof(*ls));
+	ls->running = 1;
+	ls->fd = -1;
+	ls->epfd = -1;
+	ls->out_limit = DEFAULT_OUT_QUEUE;
+	ls->get_sample = get_sample_func;
+	ls->set_dp = set_datapoint_func;
+	ls->data = data;
+	INIT_LIST_HEAD(&ls->dp_list);
+	INIT_LIST_HEAD(&ls->reg_chunks);
+	ls->persist_delay = DEFAULT_PERSIST_DELAY;
+	ls->journal_fd = -1;
+	ls->journal_compact = DEFAULT_JOURNAL_COMPACT;
+	ls->reg_chunk_size = DEFAULT_REG_CHUNK_SIZE;
+	ls->reg_window = DEFAULT_REG_WINDOW;
+#ifndef _MSC_VER
+	pthread_mutex_init(&ls->persist_lock, NULL);
+	pthread_cond_init(&ls->persist_cond, NULL);
+	pthread_cond_init(&ls->persist_idle, NULL);
+	ls->persist_sync_fd = -1;
+	INIT_LIST_HEAD(&ls->done_list);
+	pthread_mutex_init(&ls->done_lock, NULL);
+	ls->publish_limit = DEFAULT_PUBLISH_QUEUE;
+	ls->wake_fds[0] = ls->wake_fds[1] = -1;
+	if (pipe(ls->wake_fds) < 0) {
+		perror("pipe");
+		return -1;
+	}
+	fcntl(ls->wake_fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(ls->wake_fds[1], F_SETFL, O_NONBLOCK);
+	ls->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (ls->epfd < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+	{
+		struct epoll_event ev;
+
+		ev.events = EPOLLIN;
+		ev.data.fd = ls->wake_fds[0];
+		epoll_ctl(ls->epfd, EPOLL_CTL_ADD, ls->wake_fds[0], &ev);
+	}
+#endif
+	if ((ls->tokener = json_tokener_new()) == NULL) {
 		printf("Out of memory when json_tokener_new();");
-		exit(-1);
+		return -1;
+	}
+	if (cfg_file != NULL && (ls->config_file = strdup(cfg_file)) == NULL) {
+		printf("Out of memory!");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Drop what a run of an instance loaded, it can run again afterwards.
+ */
+static void lib_sensor_reset(struct lib_sensor *ls)
+{
+	struct reg_chunk *chunk, *ctmp;
+	struct datapoint *dp, *tmp;
+
+	list_for_each_entry_safe(chunk, ctmp, &ls->reg_chunks, list)
+		free_reg_chunk(chunk);
+	list_for_each_entry_safe(dp, tmp, &ls->dp_list, list)
+		del_datapoint(ls, dp);
+	if (ls->dp_table != NULL) {
+		lh_table_free(ls->dp_table);
+		ls->dp_table = NULL;
+	}
+	if (ls->config != NULL) {
+		json_object_put(ls->config);
+		ls->config = NULL;
 	}
+	free(ls->journal_file);
+	free(ls->journal_old_file);
+	ls->journal_file = ls->journal_old_file = NULL;
+	if (ls->fd >= 0) {
+		/* closing it drops it from the epoll set as well */
+		closesocket(ls->fd);
+		ls->fd = -1;
+	}
+	ls->in_len = 0;
+	ls->out_len = 0;
+	ls->reg_refs = ls->reg_sent = ls->reg_total = 0;
+	ls->probe_id = 0;
+	ls->srtt = 0;
+}
+
+int lib_sensor_open(lib_sensor_t *ls)
+{
+	struct sockaddr_in sock;
+	json_object *jo;
+	const char *host;
+	struct upload_options upopts;
+	int port, n, i;
+
+	printf("lib_sensor-%s is initializing ...\n", __stringify(VERSION));
+#ifdef _MSC_VER
+
+	WORD wVersionRequested;
+	WSADATA wsaData;
+	int err;
+
+	wVersionRequested = MAKEWORD(2, 2);
+
+	err = WSAStartup(wVersionRequested, &wsaData);
+	if (err != 0) {
+		printf("WSAStartup failed witherror: %d\n", err);
+		return -1;
+	}
+#endif
 
 	/* Load and parse configuration file */
-	config = json_object_from_file(config_file);
-	if (config == NULL) {
-		printf("Failed to parse configuration file: %s", config_file);
+	ls->config = json_object_from_file(ls->config_file);
+	if (ls->config == NULL) {
+		printf("Failed to parse configuration file: %s", ls->config_file);
 		return -1;
 	}
 
-	datapoints = json_object_object_get(config, "datapoints");
-	if (json_object_get_type(datapoints) != json_type_array) {
+	jo = json_object_object_get(ls->config, "datapoints");
+	if (json_object_get_type(jo) != json_type_array) {
 		printf("sensor config error!");
 		return -1;
 	}
+	n = json_object_array_length(jo);
+	ls->dp_table = lh_kptr_table_new(n > 16 ? 2 * n : 32, "datapoints", NULL);
+	for (i = 0; i < n; i++)
+		add_datapoint(ls, json_object_array_get_idx(jo, i));
 
 	/* try to connect to server */
-	const char *host = json_object_get_string(json_object_object_get(config, "host"));
-	int port = json_object_get_int(json_object_object_get(config, "port"));
+	host = json_object_get_string(json_object_object_get(ls->config, "host"));
+	port = json_object_get_int(json_object_object_get(ls->config, "port"));
 
-	struct sockaddr_in sock;
 	sock.sin_family = PF_INET;
 	sock.sin_port = htons(port);
 	sock.sin_addr.s_addr = inet_addr(host);
-	fd = socket(AF_INET, SOCK_STREAM, 0);
+	ls->fd = socket(AF_INET, SOCK_STREAM, 0);
 
-	if (fd < 0) {
+	if (ls->fd < 0) {
 		printf("socket() failed error: %d\n", errno);
 		return -1;
 	}
 
-	if (signal(SIGINT, sig_handler) == SIG_ERR
-#ifdef SIGQUIT
-		|| signal(SIGQUIT, sig_handler) == SIG_ERR
-#endif
-		) {
-		printf("Can't register signal handler.");
-	}
-
-	while ((ret = connect(fd, (struct sockaddr*)&sock, sizeof(struct sockaddr_in))) == -1) {
+	while (connect(ls->fd, (struct sockaddr*)&sock, sizeof(struct sockaddr_in)) == -1) {
 		if (EINPROGRESS != errno) {
 			printf("Can not connect to dmagent: %s\n", strerror(errno));
 			return -1;
@@ -545,186 +2708,480 @@ int lib_sensor_start(const char *cfg_file,
 
 	printf("sensor app successfully connected to agent.\n");
 
+#ifndef _MSC_VER
+	{
+		struct epoll_event ev;
+
+		fcntl(ls->fd, F_SETFL, fcntl(ls->fd, F_GETFL) | O_NONBLOCK);
+		ev.events = EPOLLIN;
+		ev.data.fd = ls->fd;
+		if (epoll_ctl(ls->epfd, EPOLL_CTL_ADD, ls->fd, &ev) < 0) {
+			perror("epoll_ctl");
+			return -1;
+		}
+	}
+	jo = json_object_object_get(ls->config, "publishQueue");
+	if (jo != NULL && json_object_get_int(jo) > 0)
+		ls->publish_limit = json_object_get_int(jo);
+#endif
+	jo = json_object_object_get(ls->config, "outQueueMax");
+	if (jo != NULL && json_object_get_int(jo) > 0)
+		ls->out_limit = json_object_get_int(jo);
+
+	/* upload workers, files beyond the queue drop the oldest by default */
+	jo = json_object_object_get(ls->config, "uploadWorkers");
+	upopts.workers = jo != NULL && json_object_get_int(jo) > 0 ? json_object_get_int(jo) : DEFAULT_UPLOAD_WORKERS;
+	jo = json_object_object_get(ls->config, "uploadQueue");
+	upopts.queue_size = jo != NULL && json_object_get_int(jo) > 0 ? json_object_get_int(jo) : DEFAULT_UPLOAD_QUEUE;
+	jo = json_object_object_get(ls->config, "uploadOverflow");
+	upopts.overflow = jo != NULL && strcmp(json_object_get_string(jo), "dropNewest") == 0 ? UPLOAD_DROP_NEWEST : UPLOAD_DROP_OLDEST;
+	jo = json_object_object_get(ls->config, "uploadIdleTimeout");
+	upopts.idle_timeout = jo != NULL && json_object_get_int(jo) >= 0 ? json_object_get_int(jo) : DEFAULT_UPLOAD_IDLE_TIMEOUT;
+	jo = json_object_object_get(ls->config, "dnsTtl");
+	upopts.dns_ttl = jo != NULL && json_object_get_int(jo) >= 0 ? json_object_get_int(jo) : DEFAULT_DNS_TTL;
+	jo = json_object_object_get(ls->config, "uploadRate");
+	upopts.rate = jo != NULL ? json_object_get_int64(jo) : 0;
+	jo = json_object_object_get(ls->config, "uploadLatencyMax");
+	upopts.latency_max = jo != NULL && json_object_get_int(jo) >= 0 ? json_object_get_int(jo) : DEFAULT_UPLOAD_LATENCY_MAX;
+	jo = json_object_object_get(ls->config, "uploadSpool");
+	upopts.spool_dir = jo != NULL ? json_object_get_string(jo) : NULL;
+	jo = json_object_object_get(ls->config, "uploadSpoolQuota");
+	upopts.spool_quota = jo != NULL && json_object_get_int64(jo) >= 0 ? json_object_get_int64(jo) : DEFAULT_UPLOAD_SPOOL_QUOTA;
+	ls->probe_timeout = 2 * upopts.latency_max;
+	ls->uploads = upload_pool_create(&upopts);
+	if (ls->uploads == NULL)
+		return -1;
+
+	if (persist_start(ls) < 0)
+		return -1;
+	ls->persisting = 1;
+
 	/* register datapoints to agent */
+	jo = json_object_object_get(ls->config, "regChunkSize");
+	if (jo != NULL && json_object_get_int(jo) > 0)
+		ls->reg_chunk_size = json_object_get_int(jo);
+	jo = json_object_object_get(ls->config, "regWindow");
+	if (jo != NULL && json_object_get_int(jo) > 0)
+		ls->reg_window = json_object_get_int(jo);
+	n = 0;
+	list_for_each(ls->reg_next, &ls->dp_list)
+		n++;
+	ls->reg_total = n > 0 ? (n + ls->reg_chunk_size - 1) / ls->reg_chunk_size : 1;
+	ls->reg_next = ls->dp_list.next;
+	registerdatapoints(ls);
+	return 0;
+}
 
-	int msgid = 1;
-	registerdatapoints(msgid);
+int lib_sensor_get_fd(lib_sensor_t *ls)
+{
+#ifdef _MSC_VER
+	return ls->fd;
+#else
+	return ls->epfd;
+#endif
+}
 
-	/* handling retriving messages/commands */
-	int n, i, bytes;
-	fd_set fdset;
-	int max_read_size, pos = 0;
-	unsigned int buffer_size = 1024;
-	char *buffer = malloc(buffer_size);
-	memset(buffer, 0, buffer_size);
-	long long t;
-	struct interval *inter;
-	char *msg;
-	json_object *idx, *jo, *val, *res;
-
-	while (s_running) {
-		struct timeval timeout = { 0, 10000 };
-		FD_ZERO(&fdset);
-		FD_SET(fd, &fdset);
-		ret = select(fd + 1, &fdset, NULL, NULL, &timeout);
-		if (ret == -1) {
-			printf("Server-select() error!\n");
-			return -1;
-		} else if (ret == 0) {
-			/* nothing to receive. check if we have data to send */
-			n = json_object_array_length(datapoints);
-			struct list_head *next = intervals.next;
-			int opt;
-			t = get_system_time();
-			for (i = 0; i < n; i++) {
-				idx = json_object_array_get_idx(datapoints, i);
-				opt = atoi(json_object_get_string(json_object_object_get(json_object_object_get(idx, "props"), "sampleRate")));
-				inter = list_entry(next, struct interval, list);
-				/* check if it is time to collect datapoint data */
-				if (t - inter->t > opt * 1000) {
-					msg = NULL;
-					srand(time(NULL));
+int lib_sensor_next_timeout(lib_sensor_t *ls)
+{
+	struct datapoint *dp;
+	long long now = get_system_time(), next = -1, due;
 
-					/*
-					 * Send datapoint data to the agent
-					 * Message format:
-					 * {
-					 *   "method": "data",
-					 *   "params": {
-					 *     "${datapoint_id}": {
-					 *       "date": ${date},
-					 *       "data":"${data}"
-					 *     }
-					 *   },
-					 *   "id":${msgid}
-					 * }
-					 * Here we just use strings instead of json_object to send out the message.
-					 */
-					json_object *props = json_object_object_get(idx, "props");
-					const char *datatype = json_object_get_string(json_object_object_get(props, "dataType"));
-					void *data = __get_datapoint_data(props);
-					const char *id = json_object_get_string(json_object_object_get(idx, "id"));
-					if (data != NULL) {
-						if (strcmp(datatype, "numeric") == 0) {
-							asprintf(&msg, "{\"method\": \"data\", \"params\":{\"%s\": {\"date\":%lld, \"data\":\"%lf\"}}, \"id\":%lld}",
-								id, t, *(double*)data, t);
-						} else if (strcmp(datatype, "file") == 0) {
-							if (doFileTransfer(atoi(id), (char*)data) == 0) {
-								asprintf(&msg, "{\"method\": \"data\", \"params\":{\"%s\": {\"date\":%lld, \"data\":\"%s\"}}, \"id\":%lld}",
-								         id, t, (char*)data, t);
-							} else {
-								fprintf(stderr, "upload file to server failed.\n");
-							}
-						}
-						free(data);
-					}
-					if (msg) {
-						printf("sending server data msg: %s\n", msg);
-						if ((bytes = send(fd, msg, strlen(msg), 0)) < 0) {
-							perror("write socket error!");
-							close(fd);
-							s_running = 0;
-						}
-						free(msg);
-					}
-					inter->t = t;
-				}
-				next = next->next;
-			}
-		} else {
-			/* data available, try to receive all buffer */
-			do {
-				if (pos == (buffer_size - 1)) {
-					msg = realloc(buffer, buffer_size *= 2);
-					if (msg == NULL) {
-						printf("Out of memory when allocating buffer!");
-						close(fd);
-						exit(-1);
-						return 1;
-					}
-					buffer = msg;
-					memset(buffer + pos, 0, buffer_size - pos);
-				}
-				// can not fill the entire buffer, string must be NULL terminated
-				max_read_size = buffer_size - pos - 1;
-				bytes = recv(fd, buffer + pos, max_read_size, 0);
-				if (bytes < 0) {
-					perror("read");
-					close(fd);
-					return 1;
-				}
-				pos += bytes;
-			} while (bytes == max_read_size);
+	if (!ls->running)
+		return 0;
+	list_for_each_entry(dp, &ls->dp_list, list) {
+		if (dp->type == LIB_SENSOR_UNKNOWN)
+			continue;
+		/* the completion of a read in flight wakes the loop up */
+		if (dp->async != NULL && dp->async->in_flight)
+			continue;
+		/* collected once more than the period has passed */
+		due = dp->t + effective_period(dp, now) + 1;
+		if (next < 0 || due < next)
+			next = due;
+	}
+	if ((ls->persist_dirty || ls->journal_unsynced) && (next < 0 || ls->persist_deadline < next))
+		next = ls->persist_deadline;
+	if (next < 0)
+		return -1;
+	return next <= now ? 0 : (int)(next - now);
+}
 
-			printf("message received:%s\n", buffer);
+/*
+ * Wait up to 'timeout' ms for the fds of an instance, handle the ones that
+ * are ready and run the timers.
+ */
+static int lib_sensor_poll(struct lib_sensor *ls, int timeout)
+{
+#ifdef _MSC_VER
+	struct timeval tv = { timeout / 1000, (timeout % 1000) * 1000 };
+	fd_set fdset;
+	int i, ret, maxfd = ls->fd;
 
-			/*
-			 * Message could be operation result or new request.
-			 */
-			json_tokener_reset(Json_tokener);
-			jo = json_tokener_parse_ex(Json_tokener, buffer, strlen(buffer));
-			val = json_object_object_get(jo, "error");
-			if (val == NULL) {
-				val = json_object_object_get(jo, "result");
-				if (val != NULL) {
-					/* Response */
-					if (msgid == json_object_get_int(json_object_object_get(jo, "id")) && msgid == 1) {
-						/* this is the response of reg_datapoint */
-						if (json_object_get_type(val) == json_type_boolean) {
-							json_bool r = json_object_get_boolean(val);
-							if (r == 0) {
-								/* this means there is
-								   { "result": false }
-								   in returned msg */
-								printf("Register sensor to dmagent failed.\n");
-								printf(" Please try to remove the \"id: ...\" line "
-								       "from sensor-app.json then rerun sensor "
-								       "application again.\n");
-								exit(-1);
-							}
-						}
-
-						/* reg new datapoints success ..
-						 * If the result is an array of ids, update local config file.
-						 */
-						if (json_object_get_type(val) == json_type_array) {
-							n = json_object_array_length(val);
-							for (i = 0; i < n; i++) {
-								idx = json_object_array_get_idx(val, i);
-								json_object_object_add(json_object_array_get_idx(datapoints, i), "id", json_object_get(idx));
-							}
-							/* write config back to config file */
-							json_object_to_file_ext(config_file, config, JSON_C_TO_STRING_PRETTY);
-						}
-					}
-				} else {
-					/* New Request */
-					res = json_object_new_object();
-					handle_message(jo, res);
-
-					/* Send request processed result back */
-					const char *sendbuf = json_object_get_string(res);
-					if ((bytes = send(fd, sendbuf, strlen(sendbuf), 0)) < 0) {
-						perror("write socket error!");
-						close(fd);
-						s_running = 0;
-					}
-					json_object_put(res);
-				}
-			} else {
-				printf("Message failed! Result:%s", json_object_get_string(val));
-			}
+	FD_ZERO(&fdset);
+	FD_SET(ls->fd, &fdset);
+	for (i = 0; i < ls->nwatches; i++) {
+		if (ls->watches[i].fd < 0)
+			continue;
+		FD_SET(ls->watches[i].fd, &fdset);
+		if (ls->watches[i].fd > maxfd)
+			maxfd = ls->watches[i].fd;
+	}
+	ret = select(maxfd + 1, &fdset, NULL, NULL, timeout < 0 ? NULL : &tv);
+	if (ret < 0 && errno != EINTR) {
+		printf("Server-select() error!\n");
+		ls->running = 0;
+	}
+	for (i = 0; ret > 0 && i < ls->nwatches; i++) {
+		if (ls->watches[i].fd >= 0 && FD_ISSET(ls->watches[i].fd, &fdset))
+			ls->watches[i].func(ls->watches[i].fd, ls->watches[i].arg);
+	}
+	compact_watches(ls);
+	if (ret > 0 && FD_ISSET(ls->fd, &fdset))
+		agent_recv(ls);
+#else
+	struct epoll_event events[16];
+	int i, n;
 
-			/* Message process finished, reset state for next message */
-			json_object_put(jo);
-			pos = 0;
-			memset(buffer, 0, buffer_size);
+	n = epoll_wait(ls->epfd, events, 16, timeout);
+	if (n < 0 && errno != EINTR) {
+		perror("epoll_wait");
+		ls->running = 0;
+	}
+	for (i = 0; i < n && ls->running; i++) {
+		if (events[i].data.fd == ls->fd) {
+			if (events[i].events & EPOLLOUT)
+				agent_flush(ls);
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				agent_recv(ls);
+		} else if (events[i].data.fd == ls->wake_fds[0]) {
+			handle_completions(ls);
+		} else {
+			handle_watch(ls, events[i].data.fd);
 		}
 	}
+	compact_watches(ls);
+#endif
+	if (!ls->running)
+		return -1;
+	persist_tick(ls, get_system_time(), 0);
+	collect_datapoints(ls, get_system_time());
+	return 0;
+}
+
+int lib_sensor_dispatch(lib_sensor_t *ls)
+{
+	return lib_sensor_poll(ls, 0);
+}
+
+void lib_sensor_close(lib_sensor_t *ls)
+{
+	if (ls->persisting) {
+		persist_stop(ls);
+		ls->persisting = 0;
+	}
+	upload_pool_destroy(ls->uploads);
+	ls->uploads = NULL;
+	lib_sensor_reset(ls);
 #ifdef _MSC_VER
 	WSACleanup();
 #endif
+	/* after a disconnect the instance can be opened again */
+	ls->running = !ls->stopped;
+}
+
+/*
+ * Load the config and run the message loop.
+ */
+int lib_sensor_run(lib_sensor_t *ls)
+{
+	if (lib_sensor_open(ls) < 0) {
+		lib_sensor_close(ls);
+		return -1;
+	}
+	while (ls->running) {
+		/* interrupted by a signal, running tells whether to go on */
+		lib_sensor_poll(ls, lib_sensor_next_timeout(ls));
+	}
+	lib_sensor_close(ls);
+	return 0;
+}
+
+lib_sensor_t *lib_sensor_create(const char *cfg_file, dp_sample_func_t *get_sample_func,
+	set_dp_func_t *set_datapoint_func, void *data)
+{
+	struct lib_sensor *ls;
+
+	if (cfg_file == NULL) {
+		printf("lib_sensor: wrong parameters.\n");
+		return NULL;
+	}
+	ls = malloc(sizeof(*ls));
+	if (ls == NULL) {
+		printf("Out of memory!");
+		return NULL;
+	}
+	if (lib_sensor_init(ls, cfg_file, get_sample_func, set_datapoint_func, data) < 0) {
+		lib_sensor_destroy(ls);
+		return NULL;
+	}
+	return ls;
+}
+
+void lib_sensor_stop(lib_sensor_t *ls)
+{
+	ls->stopped = 1;
+	ls->running = 0;
+#ifndef _MSC_VER
+	/* wake the loop up if it waits in epoll_wait */
+	if (write(ls->wake_fds[1], "", 1) < 0 && errno != EAGAIN)
+		perror("write wake pipe");
+#endif
+}
+
+void lib_sensor_destroy(lib_sensor_t *ls)
+{
+#ifndef _MSC_VER
+	struct lib_sensor_completion *c, *tmp;
+#endif
+
+	if (ls == NULL)
+		return;
+	lib_sensor_reset(ls);
+#ifndef _MSC_VER
+	/* reads completed after the run and samples nobody sent */
+	list_for_each_entry_safe(c, tmp, &ls->done_list, list) {
+		list_del(&c->list);
+		if (c->dp == NULL)
+			free(c->blocks);
+		props_free(c->retired);
+		free(c);
+	}
+	if (ls->wake_fds[0] >= 0) {
+		close(ls->wake_fds[0]);
+		close(ls->wake_fds[1]);
+	}
+	if (ls->epfd >= 0)
+		close(ls->epfd);
+	pthread_mutex_destroy(&ls->done_lock);
+	pthread_mutex_destroy(&ls->persist_lock);
+	pthread_cond_destroy(&ls->persist_cond);
+	pthread_cond_destroy(&ls->persist_idle);
+#endif
+	if (ls->tokener != NULL)
+		json_tokener_free(ls->tokener);
+	free(ls->in);
+	free(ls->out);
+	free(ls->config_file);
+	free(ls->data_msg);
+	free(ls->consumers);
+	free(ls->due);
+	free(ls->batch);
+	free(ls->props);
+	free(ls->samples);
+	free(ls->watches);
+	if (ls != &default_instance)
+		free(ls);
+}
+
+lib_sensor_t *lib_sensor_default(void)
+{
+	static int initialized;
+
+	if (!initialized && lib_sensor_init(&default_instance, NULL, NULL, NULL, NULL) == 0)
+		initialized = 1;
+	return &default_instance;
+}
+
+/*
+ * Run the default instance until the user interrupts it.
+ */
+static int lib_sensor_run_default(const char *cfg_file, set_dp_func_t *set_datapoint_func, void *data)
+{
+	struct lib_sensor *ls = lib_sensor_default();
+
+	free(ls->config_file);
+	ls->config_file = strdup(cfg_file);
+	ls->set_dp = set_datapoint_func;
+	ls->data = data;
+	if (ls->config_file == NULL) {
+		printf("Out of memory!");
+		return -1;
+	}
+
+	if (signal(SIGINT, sig_handler) == SIG_ERR
+#ifdef SIGQUIT
+		|| signal(SIGQUIT, sig_handler) == SIG_ERR
+#endif
+		) {
+		printf("Can't register signal handler.");
+	}
+	return lib_sensor_run(ls);
+}
+
+int lib_sensor_start(const char *cfg_file, dp_data_func_t *get_datapoint_data_func,
+	set_dp_func_t *set_datapoint_func, void *data)
+{
+	if (cfg_file == NULL || get_datapoint_data_func == NULL) {
+		printf("lib_sensor: wrong parameters.\n");
+		return -1;
+	}
+
+	/*
+	 *      Note, the 'set_datapoint_func' is optional, designed for futher extension
+	 */
+	lib_sensor_default()->get_data = get_datapoint_data_func;
+	return lib_sensor_run_default(cfg_file, set_datapoint_func, data);
+}
+
+int lib_sensor_start_ex(const char *cfg_file, dp_sample_func_t *get_sample_func,
+	set_dp_func_t *set_datapoint_func, void *data)
+{
+	if (cfg_file == NULL || get_sample_func == NULL) {
+		printf("lib_sensor: wrong parameters.\n");
+		return -1;
+	}
+
+	lib_sensor_default()->get_sample = get_sample_func;
+	return lib_sensor_run_default(cfg_file, set_datapoint_func, data);
+}
+
+void lib_sensor_set_batch_func(lib_sensor_t *ls, dp_batch_func_t *get_batch_func)
+{
+	ls->get_batch = get_batch_func;
+}
+
+int lib_sensor_set_read_func(lib_sensor_t *ls, dp_start_read_func_t *start_read_func)
+{
+#ifdef _MSC_VER
+	printf("lib_sensor: asynchronous drivers are not supported on this platform.\n");
+	return -1;
+#else
+	ls->start_read = start_read_func;
 	return 0;
+#endif
+}
+
+struct lib_sensor_sample *lib_sensor_completion_sample(struct lib_sensor_completion *completion)
+{
+	return &completion->sample;
+}
+
+void lib_sensor_complete(struct lib_sensor_completion *completion, int result)
+{
+#ifndef _MSC_VER
+	struct lib_sensor *ls = completion->ls;
+	int wake;
+
+	pthread_mutex_lock(&ls->done_lock);
+	completion->result = result;
+	wake = list_head_is_empty(&ls->done_list);
+	list_add_tail(&completion->list, &ls->done_list);
+	pthread_mutex_unlock(&ls->done_lock);
+	/* one byte is enough to wake the loop for the whole queue */
+	if (wake && write(ls->wake_fds[1], "", 1) < 0 && errno != EAGAIN)
+		perror("write wake pipe");
+#endif
+}
+
+#ifndef _MSC_VER
+/*
+ * Queue a sample for handle_completions(), from any thread. A sample of
+ * dedup_check() is 'checked': its file is not uploaded again, and it does
+ * not count against "publishQueue" as the upload queue bounds it already.
+ */
+static int queue_sample(struct lib_sensor *ls, int dp_id, const struct lib_sensor_sample *sample, int checked)
+{
+	struct lib_sensor_completion *c;
+	int wake;
+
+	c = malloc(sizeof(*c));
+	if (c == NULL)
+		return -1;
+	c->ls = ls;
+	c->dp = NULL;
+	c->blocks = NULL;
+	c->retired = NULL;
+	c->checked = checked;
+	c->id = dp_id;
+	c->sample = *sample;
+	/* the props of the driver may be gone by the time it is sent */
+	c->sample.props = NULL;
+	if (c->sample.timestamp == 0)
+		c->sample.timestamp = get_system_time();
+
+	pthread_mutex_lock(&ls->done_lock);
+	if (ls->wake_fds[1] < 0 || (!checked && ls->published >= ls->publish_limit)) {
+		pthread_mutex_unlock(&ls->done_lock);
+		free(c);
+		return -1;
+	}
+	if (!checked)
+		ls->published++;
+	wake = list_head_is_empty(&ls->done_list);
+	list_add_tail(&c->list, &ls->done_list);
+	pthread_mutex_unlock(&ls->done_lock);
+	if (wake && write(ls->wake_fds[1], "", 1) < 0 && errno != EAGAIN)
+		perror("write wake pipe");
+	return 0;
+}
+#endif
+
+int lib_sensor_publish(lib_sensor_t *ls, int dp_id, const struct lib_sensor_sample *sample)
+{
+#ifdef _MSC_VER
+	return -1;
+#else
+	/* the block would have to outlive the call */
+	if (dp_id <= 0 || sample == NULL || sample->type == LIB_SENSOR_WAVEFORM)
+		return -1;
+	return queue_sample(ls, dp_id, sample, 0);
+#endif
+}
+
+int lib_sensor_watch_fd(lib_sensor_t *ls, int wfd, lib_sensor_fd_func_t *func, void *arg)
+{
+	struct fd_watch *p;
+
+#ifdef _MSC_VER
+	if (wfd < 0 || wfd >= FD_SETSIZE || func == NULL)
+		return -1;
+#else
+	struct epoll_event ev;
+
+	if (wfd < 0 || func == NULL)
+		return -1;
+#endif
+	if (ls->nwatches == ls->watches_size) {
+		p = realloc(ls->watches, (ls->watches_size ? 2 * ls->watches_size : 16) * sizeof(*p));
+		if (p == NULL)
+			return -1;
+		ls->watches = p;
+		ls->watches_size = ls->watches_size ? 2 * ls->watches_size : 16;
+	}
+#ifndef _MSC_VER
+	ev.events = EPOLLIN;
+	ev.data.fd = wfd;
+	if (epoll_ctl(ls->epfd, EPOLL_CTL_ADD, wfd, &ev) < 0)
+		return -1;
+#endif
+	ls->watches[ls->nwatches].fd = wfd;
+	ls->watches[ls->nwatches].func = func;
+	ls->watches[ls->nwatches].arg = arg;
+	ls->nwatches++;
+	return 0;
+}
+
+void lib_sensor_unwatch_fd(lib_sensor_t *ls, int wfd)
+{
+	int i;
+
+	for (i = 0; i < ls->nwatches; i++) {
+		if (ls->watches[i].fd == wfd)
+			ls->watches[i].fd = -1;
+	}
+#ifndef _MSC_VER
+	epoll_ctl(ls->epfd, EPOLL_CTL_DEL, wfd, NULL);
+#endif
 }
 
 void * get_node_by_name(void *pnode, const char *name)
@@ -759,141 +3216,190 @@ const char *get_string_by_name(void *node, const char *name)
 	return json_object_get_string(js_node);
 }
 
-int int_from_config_by_name(const char *name)
+lib_sensor_prop_t lib_sensor_prop(const char *name)
 {
-	return json_object_get_int(json_object_object_get(config, name));
+	lib_sensor_prop_t prop = -1;
+	int i;
+
+	if (name == NULL)
+		return -1;
+#ifndef _MSC_VER
+	pthread_mutex_lock(&prop_lock);
+#endif
+	for (i = 0; i < prop_count; i++) {
+		if (strcmp(prop_names[i], name) == 0) {
+			prop = i;
+			goto out;
+		}
+	}
+	if (prop_count < PROP_MAX && (prop_names[prop_count] = strdup(name)) != NULL)
+		prop = prop_count++;
+out:
+#ifndef _MSC_VER
+	pthread_mutex_unlock(&prop_lock);
+#endif
+	return prop;
 }
 
-const char *string_from_config_by_name(const char *name)
+/*
+ * The cached value of a prop, NULL if the datapoint has not been updated
+ * since the handle was taken.
+ */
+static const struct prop_value *prop_value(const struct lib_sensor_sample *sample, lib_sensor_prop_t prop)
 {
-	return json_object_get_string(json_object_object_get(config, name));
+	if (prop < 0 || sample->props == NULL || prop >= sample->props->n)
+		return NULL;
+	return &sample->props->v[prop];
 }
 
-static void *http_putfile(void *thread_param)
+/*
+ * Look a prop up by name when it is not cached.
+ */
+static json_object *prop_node(const struct lib_sensor_sample *sample, lib_sensor_prop_t prop)
 {
-	if (thread_param == NULL)
+	if (prop < 0 || prop >= PROP_MAX || sample->props == NULL)
 		return NULL;
+	return json_object_object_get(sample->props->node, prop_names[prop]);
+}
 
-#ifndef _MSC_VER
-	pthread_detach(pthread_self());
-#endif
+int lib_sensor_prop_int(const struct lib_sensor_sample *sample, lib_sensor_prop_t prop)
+{
+	const struct prop_value *v = prop_value(sample, prop);
 
-	FILE *fp;
-	struct hostent *hptr;
-	struct sockaddr_in servaddr;
-	struct upload_info *upinfo = (struct upload_info *)thread_param;
-	char buf[256] = {};
-	int i, sockfd=0, size;
-	int n;
-	char *sendline = NULL;
-	char recvline[MAXLINE + 1];
-	int ret = 0;
+	return v != NULL ? v->i : json_object_get_int(prop_node(sample, prop));
+}
 
-	/* get size of the file */
-	fp = fopen(upinfo->file, "r");
-	if (fp == NULL) {
-		printf("Fail to read file: %s\n", upinfo->file);
-		goto cleanup;
-	}
-	ret = fseek(fp, 0L, SEEK_END);
-	if (ret < 0) {
-		fprintf(stderr, "fseek error: %d\n", errno);
-		goto cleanup;
-	}
-	size = ftell(fp);
-	if (size < 0) {
-		fprintf(stderr, "ftell error: %d\n", errno);
-		goto cleanup;
-	}
+double lib_sensor_prop_double(const struct lib_sensor_sample *sample, lib_sensor_prop_t prop)
+{
+	const struct prop_value *v = prop_value(sample, prop);
 
-	if ((hptr = gethostbyname(upinfo->host)) == NULL) {
-		printf("gethostbyname error for host: %s\n", upinfo->host);
-		goto cleanup;
-	}
+	return v != NULL ? v->d : json_object_get_double(prop_node(sample, prop));
+}
 
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (sockfd < 0) {
-		fprintf(stderr, "create socket error: %d\n", errno);
-		goto cleanup;
-	}
+const char *lib_sensor_prop_string(const struct lib_sensor_sample *sample, lib_sensor_prop_t prop)
+{
+	const struct prop_value *v = prop_value(sample, prop);
 
-	memset(&servaddr, 0, sizeof(servaddr));
-	servaddr.sin_family = AF_INET;
-	servaddr.sin_port = htons(upinfo->port);
-	memcpy(&(servaddr.sin_addr.s_addr), hptr->h_addr, hptr->h_length);
+	return v != NULL ? v->s : json_object_get_string(prop_node(sample, prop));
+}
 
-	for (i = 0; i < upinfo->retry; i++) {
-		while ((ret = connect(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr))) < 0) {
-			if (EINPROGRESS != errno) {
-				fprintf(stderr, "connect to server error: %d\n", errno);
-				break;
-			}
-		}
+void *lib_sensor_context(const struct lib_sensor_sample *sample)
+{
+	return sample->props != NULL ? sample->props->context : NULL;
+}
 
-		if (ret < 0) continue;
+int lib_sensor_set_context(const struct lib_sensor_sample *sample, void *context, void (*free_context)(void *))
+{
+	struct lib_sensor_props *props = (struct lib_sensor_props *)sample->props;
 
-		ret = fseek(fp, 0L, SEEK_SET);
-		if (ret < 0) {
-			fprintf(stderr, "feek error #1: %d\n", errno);
-			goto cleanup;
-		}
+	if (props == NULL)
+		return -1;
+	if (props->free_context != NULL && props->context != context)
+		props->free_context(props->context);
+	props->context = context;
+	props->free_context = free_context;
+	return 0;
+}
 
-		if (sendline != NULL) {
-			free(sendline);
-			sendline = NULL;
-		}
+int lib_sensor_file_fd(struct lib_sensor_sample *sample, int fd)
+{
+	struct lib_sensor_props *props = (struct lib_sensor_props *)sample->props;
 
-		ret = asprintf(&sendline,
-			"PUT %s HTTP/1.1\r\n"
-			"HOST: %s\r\n"
-			"Content-type: application/octet-stream\r\n"
-			"Content-length: %d\r\n\r\n"
-			, upinfo->url, upinfo->host, size);
-		if (ret < 0) {
-			fprintf(stderr, "memory exhausted.\n");
-			continue;
-		}
+	if (fd < 0)
+		return -1;
+	if (props == NULL || sample->type != LIB_SENSOR_FILE) {
+		close(fd);
+		return -1;
+	}
+	if (props->file_fd >= 0)
+		close(props->file_fd);
+	props->file_fd = fd;
+	return 0;
+}
 
-		if ((n = send(sockfd, sendline, strlen(sendline), 0)) > 0) {
-			while (fread(buf, 1, sizeof(buf), fp) > 0) {
-				if ((n = send(sockfd, buf, sizeof(buf), 0)) <= 0)
-					break;
-			}
-		}
+#ifndef _MSC_VER
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
 
-		while ((n = recv(sockfd, recvline, MAXLINE, 0)) > 0) {
-#if 0
-			/* dump out received header */
-			recvline[n] = '\0';
-			printf("%s", recvline);
+/*
+ * A file that is kept in memory only: a memfd, or on kernels without
+ * memfd_create() an unlinked file in /dev/shm.
+ */
+static int mem_file_create(void)
+{
+	static unsigned int seq;
+	char name[64];
+	int fd, i;
+
+#ifdef SYS_memfd_create
+	fd = syscall(SYS_memfd_create, "libsensor", MFD_CLOEXEC);
+	if (fd >= 0)
+		return fd;
 #endif
-			if (strstr(recvline, "204 No Content") != NULL) {
-				fflush(stdout);
-				ret = 0;
-				i = upinfo->retry;
-				close(sockfd);
-				sockfd = -1;
-				goto cleanup;
-			}
+	for (i = 0; i < 16; i++) {
+		snprintf(name, sizeof(name), "/dev/shm/libsensor-%d-%u", (int)getpid(), __sync_fetch_and_add(&seq, 1));
+		fd = open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+		if (fd >= 0) {
+			unlink(name);
+			return fd;
 		}
+		if (errno != EEXIST)
+			break;
 	}
+	return -1;
+}
+#endif
 
-cleanup:
-	if (sockfd > 0)
-		close(sockfd);
+int lib_sensor_file_data(struct lib_sensor_sample *sample, const void *data, size_t len)
+{
+#ifdef _MSC_VER
+	return -1;
+#else
+	const char *p = data;
+	ssize_t n;
+	int fd;
+
+	if (sample->props == NULL || sample->type != LIB_SENSOR_FILE)
+		return -1;
+	fd = mem_file_create();
+	if (fd < 0) {
+		fprintf(stderr, "create memory file error: %s\n", strerror(errno));
+		return -1;
+	}
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			fprintf(stderr, "write memory file error: %s\n", strerror(errno));
+			close(fd);
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return lib_sensor_file_fd(sample, fd);
+#endif
+}
 
-	if (fp != NULL)
-		fclose(fp);
+int lib_sensor_config_int(lib_sensor_t *ls, const char *name)
+{
+	return json_object_get_int(json_object_object_get(ls->config, name));
+}
 
-	remove(upinfo->file);
-	if (upinfo->host != NULL)
-		free(upinfo->host);
-	if (upinfo->url != NULL)
-		free(upinfo->url);
-	if (upinfo->file != NULL)
-		free(upinfo->file);
+const char *lib_sensor_config_string(lib_sensor_t *ls, const char *name)
+{
+	return json_object_get_string(json_object_object_get(ls->config, name));
+}
 
-	free(upinfo);
+/* the default instance only, the API predates lib_sensor_create() */
+int int_from_config_by_name(const char *name)
+{
+	return lib_sensor_config_int(&default_instance, name);
+}
 
-	return NULL;
+const char *string_from_config_by_name(const char *name)
+{
+	return lib_sensor_config_string(&default_instance, name);
 }
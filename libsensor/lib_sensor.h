@@ -10,6 +10,12 @@
 #ifndef __LIB_SENSOR_H
 #define __LIB_SENSOR_H
 
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /**
  * 函数指针类型定义。
  *
@@ -22,6 +28,148 @@
  */
 typedef void * dp_data_func_t(void *prop_node);
 
+/**
+ * 数据点采样值的类型，由数据点的 dataType 属性决定。
+ *
+ * vector 类型的数据点在一次采集中取得多个数值（例如三轴加速度计的三个轴），由以下属性描述：
+ *
+ *   fields:     各数值的名称，以逗号分隔，最多 LIB_SENSOR_VECTOR_MAX 个，例如 "x,y,z"
+ *
+ *   fieldType:  各数值的编码，"float"（默认）、"double"、"int16" 或 "int32"
+ *
+ * 上报时各数值按 fields 的顺序以小端字节序紧凑排列为一条记录，经 base64 编码后作为 data 发送。
+ *
+ * waveform 类型的数据点每次采集一个数据块，块中是高频采集（例如 kHz 级的 ADC）的 int16 采样点，由以下属性描述：
+ *
+ *   blockSize:  数据块的容量（采样点个数），默认为 4096
+ *
+ *   waveRate:   采样频率（Hz）
+ *
+ * libsensor 为每个数据点分配两个数据块并轮流交给 sensor application 填写，异步采集时，
+ * 一个数据块发送的同时可以在另一个数据块中采集。sampleRate 为 0 时上一块完成后立即开始采集下一块。
+ * 上报时数据块以小端字节序经 base64 编码后作为 data 发送，采样频率作为 rate 发送。
+ * waveform 类型不支持旧的 dp_data_func_t，也不能通过 lib_sensor_publish 上报。
+ */
+enum lib_sensor_type {
+	LIB_SENSOR_NUMERIC = 0,		/* "numeric"，value.numeric 有效 */
+	LIB_SENSOR_FILE,		/* "file"，value.file 有效 */
+	LIB_SENSOR_VECTOR,		/* "vector"，value.vector 有效 */
+	LIB_SENSOR_WAVEFORM,		/* "waveform"，value.waveform 有效 */
+	LIB_SENSOR_UNKNOWN = -1
+};
+
+/**
+ * 采样值的状态。
+ */
+enum lib_sensor_status {
+	LIB_SENSOR_OK = 0,		/* 新采集的数据 */
+	LIB_SENSOR_STALE,		/* 本次采集失败，沿用上一次的有效数据 */
+	LIB_SENSOR_FAILED		/* 本次采集失败，不上报数据，用于批量采集中单个数据点的失败 */
+};
+
+#define LIB_SENSOR_PATH_MAX 256
+#define LIB_SENSOR_VECTOR_MAX 16
+
+/**
+ * waveform 类型数据点的数据块，由 libsensor 分配，sensor application 不需要也不应该释放。
+ *
+ *   rate:       采样频率（Hz），libsensor 预先填为 waveRate 属性
+ *
+ *   n:          已填写的采样点个数，libsensor 预先填为 0
+ *
+ *   size:       data 的容量（采样点个数）
+ *
+ *   data:       采样点，第一个采样点的时间为采样值的 timestamp
+ */
+struct lib_sensor_block {
+	int rate;
+	int n;
+	int size;
+	short *data;
+};
+
+/**
+ * 数据点属性的缓存，由 libsensor 管理，见 lib_sensor_prop。
+ */
+struct lib_sensor_props;
+
+/**
+ * 数据点采样值。
+ *
+ * 由 libsensor 分配并传给 dp_sample_func_t 填写，sensor application 不需要也不应该释放。
+ *
+ *   type:       采样值的类型，由 libsensor 根据数据点的 dataType 属性预先填好
+ *
+ *   status:     采样值的状态，libsensor 预先填为 LIB_SENSOR_OK
+ *
+ *   timestamp:  采样时间（毫秒），libsensor 预先填为当前时间，sensor application 可以改写
+ *
+ *   value:      采样值，numeric 类型填写 value.numeric，file 类型将文件路径写入 value.file，
+ *               vector 类型按 fields 属性的顺序填写 value.vector.v，value.vector.n 由 libsensor 预先填为 fields 的个数，
+ *               waveform 类型将采样点写入 value.waveform 所指向的数据块。
+ *               file 类型的文件由上传线程上传到云端，上传后删除，见配置文件的上传设置。
+ *
+ *   props:      数据点属性的缓存，由 libsensor 填好，供 lib_sensor_prop_int 等函数使用
+ */
+struct lib_sensor_sample {
+	int type;
+	int status;
+	long long timestamp;
+	union {
+		double numeric;
+		char file[LIB_SENSOR_PATH_MAX];
+		struct {
+			int n;
+			double v[LIB_SENSOR_VECTOR_MAX];
+		} vector;
+		struct lib_sensor_block *waveform;
+	} value;
+	const struct lib_sensor_props *props;
+};
+
+/**
+ * 函数指针类型定义。
+ *
+ * 与 dp_data_func_t 作用相同，但采样值写入 libsensor 提供的 sample 中，采样过程无需分配内存。
+ * sensor application 应该实现此类型的函数并将其传递给 lib_sensor_start_ex 调用。
+ *
+ * 参数说明：
+ *
+ *   prop_node:  指向数据点的属性指针
+ *
+ *   sample:     采样值，由 sensor application 填写
+ *
+ * 返回值：
+ *
+ *    0：采样成功
+ *
+ *   -1：采样失败，本次不上报数据
+ */
+typedef int dp_sample_func_t(void *prop_node, struct lib_sensor_sample *sample);
+
+/**
+ * 函数指针类型定义。
+ *
+ * 批量采集函数。属性中 bus 相同，并且在同一次调度中到期的数据点将通过一次调用交给此函数，
+ * sensor application 可以在一次硬件操作中取得所有数据点的数据（例如一次 modbus 读取多个寄存器）。
+ * 没有 bus 属性的数据点仍然通过 dp_sample_func_t 逐个采集。
+ *
+ * 参数说明：
+ *
+ *   prop_nodes: 各数据点的属性指针
+ *
+ *   n:          数据点个数
+ *
+ *   samples:    与 prop_nodes 一一对应的采样值，由 sensor application 填写，单个数据点采集失败时将其 status 设为 LIB_SENSOR_FAILED
+ *
+ * 返回值：
+ *
+ *    0：采样成功
+ *
+ *   -1：采样失败，本次所有数据点都不上报数据
+ */
+typedef int dp_batch_func_t(void *prop_nodes[], int n, struct lib_sensor_sample samples[]);
+
 /**
  * 函数指针类型定义。
  *
@@ -37,6 +185,44 @@ typedef void * dp_data_func_t(void *prop_node);
  */
 typedef void set_dp_func_t(void *prop_node, void *data);
 
+/**
+ * 配置文件的上传设置
+ *
+ * file 类型采样值的文件由后台的上传线程上传到云端，上传后删除。配置文件的顶层可以设置：
+ *
+ *   uploadWorkers:      上传线程的个数，默认 2
+ *
+ *   uploadQueue:        排队等待上传的文件个数上限，默认 16
+ *
+ *   uploadOverflow:     队列满时丢弃最早的（"dropOldest"，默认）或最新的（"dropNewest"）文件
+ *
+ *   uploadIdleTimeout:  上传线程与云端的连接保持打开供之后的上传复用，空闲该秒数后关闭，默认 30，为 0 时不复用
+ *
+ *   uploadChunkSize:    大于该字节数的文件分块上传，中断后从云端已确认的位置继续，云端须支持 Content-Range，
+ *                       默认 0，不分块
+ *
+ *   dnsTtl:             云端地址由后台线程解析并缓存该秒数，默认 300，重新解析失败时继续使用上次解析到的地址
+ *
+ *   uploadRate:         全部上传合计的速率上限（字节/秒），默认 0，不限
+ *
+ *   uploadLatencyMax:   设备代理端应答数据消息的延迟超过该毫秒数时上传逐级降速，low 与 normal 的上传依次暂停，
+ *                       延迟回落后恢复，默认 2000，为 0 时不限
+ *
+ *   uploadSpool:        文件先移入该目录并记入其中的 index 文件，上传成功后才删除，失败的文件稍后重试，
+ *                       重启后继续上传（仅限 Linux）；此时 uploadQueue 与 uploadOverflow 只限制不在该目录中的文件
+ *                       （内存中的文件与未能移入的文件）
+ *
+ *   uploadSpoolQuota:   uploadSpool 目录中的文件合计超过该字节数时从最早的文件开始丢弃，默认 64MB，为 0 时不限
+ *
+ * file 类型数据点的属性中可以设置：
+ *
+ *   uploadPriority:     上传的先后，"high"、"normal"（默认）或 "low"
+ *
+ *   uploadDedup:        为 "true" 时，内容（XXH64 与长度）与该数据点上一个上传成功的文件相同的文件不再上传而直接删除，
+ *                       发给设备代理端的数据改为上一个文件的路径。文件由上传线程检查，数据在检查之后才发出；
+ *                       getData 的应答不等待检查，文件照常上传。仅支持 POSIX 平台
+ */
+
 /**
  * libsensor 的入口函数
  *
@@ -65,6 +251,278 @@ typedef void set_dp_func_t(void *prop_node, void *data);
  */
 int lib_sensor_start(const char *cfg_file, dp_data_func_t *get_dp_func, set_dp_func_t *set_dp_func, void *data);
 
+/**
+ * libsensor 的入口函数
+ *
+ * 与 lib_sensor_start 相同，但使用 dp_sample_func_t 类型的函数采集数据。
+ *
+ * 参数说明：
+ *
+ *   cfg_file:        sensor application 的配置文件路径及名称
+ *
+ *   get_sample_func: sensor application 自定义函数，将会被 libsensor 调用以获取设备数据
+ *
+ *   set_dp_func:     sensor application 自定义函数，将会被 libsensor 调用以操作数据点
+ *
+ *   data:            sensor application 自定义数据类型，将会在 set_dp_func 函数被调用时作为其参数传入
+ *
+ * 返回值：
+ *
+ *   -1：初始化错误
+ *
+ *    0：用户中断执行
+ */
+int lib_sensor_start_ex(const char *cfg_file, dp_sample_func_t *get_sample_func, set_dp_func_t *set_dp_func, void *data);
+
+/**
+ * libsensor 实例。
+ *
+ * 每个实例有各自的配置文件、数据点和与 ithing 设备代理端的连接，一个进程中可以在不同线程里同时运行多个实例。
+ * lib_sensor_start 和 lib_sensor_start_ex 运行的是 lib_sensor_default 返回的默认实例。
+ *
+ * 默认实例在进程中只有一个，以下接口隐含地使用它，不能用于其他实例：
+ *
+ *   lib_sensor_start、lib_sensor_start_ex：为进程注册 SIGINT（及 SIGQUIT）处理函数，收到信号时只停止默认实例；
+ *                    同时运行其他实例时，应由 sensor application 自行处理信号并对各实例调用 lib_sensor_stop
+ *
+ *   int_from_config_by_name、string_from_config_by_name：只读取默认实例的配置，
+ *                    其他实例请使用 lib_sensor_config_int、lib_sensor_config_string
+ */
+typedef struct lib_sensor lib_sensor_t;
+
+/**
+ * 创建 libsensor 实例，此时不读取配置文件，也不连接设备代理端。
+ *
+ * 参数说明：
+ *
+ *   cfg_file:        sensor application 的配置文件路径及名称
+ *
+ *   get_sample_func: sensor application 自定义函数，将会被 libsensor 调用以获取设备数据；只使用批量或异步采集时可以为 NULL
+ *
+ *   set_dp_func:     sensor application 自定义函数，将会被 libsensor 调用以操作数据点
+ *
+ *   data:            sensor application 自定义数据类型，将会在 set_dp_func 函数被调用时作为其参数传入
+ *
+ * 返回值： 新的实例，失败时返回 NULL
+ */
+lib_sensor_t *lib_sensor_create(const char *cfg_file, dp_sample_func_t *get_sample_func, set_dp_func_t *set_dp_func, void *data);
+
+/**
+ * 在当前线程中运行实例的消息处理循环，直到 lib_sensor_stop 被调用或连接断开才返回。
+ * 返回后可以再次运行，配置文件将重新读取。libsensor 不为实例注册信号处理函数。
+ *
+ * 返回值：
+ *
+ *   -1：初始化错误
+ *
+ *    0：被 lib_sensor_stop 停止或设备代理端断开连接
+ */
+int lib_sensor_run(lib_sensor_t *ls);
+
+/**
+ * 停止实例的消息处理循环，可以在任意线程中调用。
+ */
+void lib_sensor_stop(lib_sensor_t *ls);
+
+/**
+ * 以下函数用于在 sensor application 已有的事件循环（epoll、libuv、Qt 等）中驱动实例，
+ * 代替 lib_sensor_run，不需要额外的线程。用法：
+ *
+ *   lib_sensor_open(ls);
+ *   将 lib_sensor_get_fd(ls) 加入事件循环，可读时或等待 lib_sensor_next_timeout(ls) 毫秒后调用 lib_sensor_dispatch(ls)；
+ *   lib_sensor_dispatch 返回 -1 后调用 lib_sensor_close(ls)。
+ *
+ * 这些函数须在同一线程中调用。
+ */
+
+/**
+ * 读取配置文件，连接设备代理端并开始注册数据点。
+ *
+ * 返回值：
+ *
+ *    0：成功
+ *
+ *   -1：初始化错误，仍须调用 lib_sensor_close
+ */
+int lib_sensor_open(lib_sensor_t *ls);
+
+/**
+ * 取得实例的文件描述符，该描述符可读时应调用 lib_sensor_dispatch。
+ * 在 Linux 上是实例内部的 epoll 描述符，汇集了设备代理端连接、异步采集以及 lib_sensor_watch_fd 监视的描述符。
+ */
+int lib_sensor_get_fd(lib_sensor_t *ls);
+
+/**
+ * 距下一次需要调用 lib_sensor_dispatch 的毫秒数，用于事件循环的超时时间。
+ *
+ * 返回值：
+ *
+ *   -1：没有定时任务，只需等待 lib_sensor_get_fd 可读
+ *
+ *   >=0：毫秒数，实例已停止时为 0
+ */
+int lib_sensor_next_timeout(lib_sensor_t *ls);
+
+/**
+ * 处理已就绪的消息和到期的采集，不会阻塞。
+ *
+ * 返回值：
+ *
+ *    0：成功
+ *
+ *   -1：实例已被 lib_sensor_stop 停止或设备代理端断开连接，应调用 lib_sensor_close
+ */
+int lib_sensor_dispatch(lib_sensor_t *ls);
+
+/**
+ * 断开与设备代理端的连接并释放配置，之后可以再次调用 lib_sensor_open。
+ */
+void lib_sensor_close(lib_sensor_t *ls);
+
+/**
+ * 销毁实例。须在 lib_sensor_run 返回之后调用，未完成的异步采集须在此之前全部完成。
+ */
+void lib_sensor_destroy(lib_sensor_t *ls);
+
+/**
+ * 取得 lib_sensor_start 和 lib_sensor_start_ex 使用的默认实例，用于在调用入口函数之前设置批量采集函数等。
+ */
+lib_sensor_t *lib_sensor_default(void);
+
+/**
+ * 异步采集的上下文，由 libsensor 分配和管理，sensor application 不需要也不应该释放。
+ */
+struct lib_sensor_completion;
+
+/**
+ * 函数指针类型定义。
+ *
+ * 异步采集函数。libsensor 在数据点需要采集时调用此函数，函数启动采集后应立即返回，不应等待设备。
+ * 采集完成后，sensor application 将采样值写入 lib_sensor_completion_sample(completion)，
+ * 再调用 lib_sensor_complete(completion, result)。同一数据点在上一次采集完成之前不会再次被调用。
+ *
+ * 参数说明：
+ *
+ *   prop_node:  指向数据点的属性指针
+ *
+ *   completion: 本次采集的上下文，在调用 lib_sensor_complete 之前一直有效
+ *
+ * 返回值：
+ *
+ *    0：采集已启动（也可以在函数返回前调用 lib_sensor_complete）
+ *
+ *   -1：无法启动采集，本次不上报数据，不应再调用 lib_sensor_complete
+ */
+typedef int dp_start_read_func_t(void *prop_node, struct lib_sensor_completion *completion);
+
+/**
+ * 函数指针类型定义。
+ *
+ * lib_sensor_watch_fd 监视的文件描述符可读时，libsensor 在消息处理循环中调用此函数。
+ *
+ * 参数说明：
+ *
+ *   fd:   可读的文件描述符
+ *
+ *   arg:  调用 lib_sensor_watch_fd 时传入的参数
+ */
+typedef void lib_sensor_fd_func_t(int fd, void *arg);
+
+/**
+ * 设置批量采集函数，须在实例运行之前调用。
+ *
+ * 参数说明：
+ *
+ *   ls:             libsensor 实例
+ *
+ *   get_batch_func: sensor application 自定义函数，为 NULL 时所有数据点都逐个采集
+ */
+void lib_sensor_set_batch_func(lib_sensor_t *ls, dp_batch_func_t *get_batch_func);
+
+/**
+ * 设置异步采集函数，须在实例运行之前调用。设置后所有数据点都通过此函数采集，
+ * getData 请求返回最近一次完成的采样值，file 类型返回其上传时发给设备代理端的文件名，不再重新上传。仅支持 POSIX 平台。
+ *
+ * 参数说明：
+ *
+ *   ls:              libsensor 实例
+ *
+ *   start_read_func: sensor application 自定义函数
+ *
+ * 返回值：
+ *
+ *    0：设置成功
+ *
+ *   -1：当前平台不支持
+ */
+int lib_sensor_set_read_func(lib_sensor_t *ls, dp_start_read_func_t *start_read_func);
+
+/**
+ * 取得异步采集的采样值，sensor application 在调用 lib_sensor_complete 之前填写。
+ * type、status、timestamp 已由 libsensor 预先填好，含义与 dp_sample_func_t 相同。
+ */
+struct lib_sensor_sample *lib_sensor_completion_sample(struct lib_sensor_completion *completion);
+
+/**
+ * 完成一次异步采集，可以在任意线程中调用。调用之后 completion 不能再被使用。
+ *
+ * 参数说明：
+ *
+ *   completion: dp_start_read_func_t 收到的上下文
+ *
+ *   result:     0 表示采集成功，-1 表示采集失败，本次不上报数据
+ */
+void lib_sensor_complete(struct lib_sensor_completion *completion, int result);
+
+/**
+ * 主动上报数据点的采样值，用于门磁、脉冲计数、自行输出数据的串口设备等事件型传感器，可以在任意线程中随时调用。
+ * 采样值与周期性采集的数据一起，经同一消息处理循环发送给 ithing 设备代理端。
+ * 排队等待发送的采样值个数不超过配置文件中的 publishQueue（默认 1024），超出时返回失败。仅支持 POSIX 平台。
+ *
+ * 参数说明：
+ *
+ *   ls:      libsensor 实例
+ *
+ *   dp_id:   数据点 id
+ *
+ *   sample:  采样值，函数返回后即可重用；type 须与数据点的 dataType 一致，timestamp 为 0 时使用当前时间
+ *
+ * 返回值：
+ *
+ *    0：成功
+ *
+ *   -1：参数错误、消息处理循环尚未启动或等待发送的采样值过多
+ */
+int lib_sensor_publish(lib_sensor_t *ls, int dp_id, const struct lib_sensor_sample *sample);
+
+/**
+ * 在 libsensor 的消息处理循环中监视文件描述符（例如串口），可读时调用 func，
+ * sensor application 无需为每个设备单独创建线程等待数据。
+ * 只能在实例的消息处理循环中调用（即在 dp_start_read_func_t 或 lib_sensor_fd_func_t 中），或在实例运行之前调用。
+ *
+ * 参数说明：
+ *
+ *   ls:    libsensor 实例
+ *
+ *   fd:    文件描述符
+ *
+ *   func:  可读时调用的函数
+ *
+ *   arg:   传给 func 的参数
+ *
+ * 返回值：
+ *
+ *    0：成功
+ *
+ *   -1：参数错误或内存不足
+ */
+int lib_sensor_watch_fd(lib_sensor_t *ls, int fd, lib_sensor_fd_func_t *func, void *arg);
+
+/**
+ * 停止监视文件描述符，调用限制与 lib_sensor_watch_fd 相同。
+ */
+void lib_sensor_unwatch_fd(lib_sensor_t *ls, int fd);
+
 /**
  * libsensor 提供的辅助函数
  *
@@ -125,10 +583,130 @@ double get_double_by_name(void *node, const char *name);
  */
 const char *get_string_by_name(void *node, const char *name);
 
+/**
+ * 数据点属性的句柄，见 lib_sensor_prop。
+ */
+typedef int lib_sensor_prop_t;
+
+/**
+ * libsensor 提供的辅助函数
+ *
+ * 取得数据点属性名称所对应的句柄。句柄对整个进程有效，同一名称总是得到同一句柄，
+ * 通常在调用 lib_sensor_start_ex 或 lib_sensor_run 之前取得。句柄不属于某个实例，
+ * 进程中的所有实例共用同一组句柄和 64 个的上限，所有实例的数据点都缓存全部句柄对应的属性值。
+ * libsensor 在数据点属性变化时将句柄对应的属性值转换好并缓存，采集时用 lib_sensor_prop_int 等函数读取，
+ * 无需再按名称查找和转换。
+ *
+ * 参数说明：
+ *
+ *   name：    数据点的属性名称
+ *
+ * 返回值： 属性的句柄，句柄数超过 64 个时返回 -1
+ */
+lib_sensor_prop_t lib_sensor_prop(const char *name);
+
+/**
+ * libsensor 提供的辅助函数
+ *
+ * 与 get_int_by_name 相同，但从采样值所属数据点的属性缓存中取值，用于 dp_sample_func_t、dp_batch_func_t
+ * 以及异步采集（lib_sensor_completion_sample）中。
+ *
+ * 参数说明：
+ *
+ *   sample：  libsensor 传给 sensor application 的采样值
+ *
+ *   prop：    lib_sensor_prop 返回的句柄
+ *
+ * 返回值： 属性所对应的数值，属性不存在时为 0
+ */
+int lib_sensor_prop_int(const struct lib_sensor_sample *sample, lib_sensor_prop_t prop);
+
+/**
+ * libsensor 提供的辅助函数
+ *
+ * 与 lib_sensor_prop_int 相同，取得 double 类型数值
+ */
+double lib_sensor_prop_double(const struct lib_sensor_sample *sample, lib_sensor_prop_t prop);
+
+/**
+ * libsensor 提供的辅助函数
+ *
+ * 与 lib_sensor_prop_int 相同，取得 string 类型数值
+ *
+ * 返回值： 指向属性所对应字符串的指针，属性不存在时为 NULL；在数据点属性下次变化之前有效
+ */
+const char *lib_sensor_prop_string(const struct lib_sensor_sample *sample, lib_sensor_prop_t prop);
+
+/**
+ * libsensor 提供的辅助函数
+ *
+ * 取得采样值所属数据点上由 lib_sensor_set_context 设置的 sensor application 数据，未设置时返回 NULL。
+ */
+void *lib_sensor_context(const struct lib_sensor_sample *sample);
+
+/**
+ * libsensor 提供的辅助函数
+ *
+ * 在采样值所属的数据点上保存 sensor application 的数据（例如根据属性解析好的驱动状态），
+ * 之后的采集中用 lib_sensor_context 取回。数据点的属性变化或数据点被删除时，
+ * libsensor 调用 free_context 释放数据，并将其重置为 NULL。
+ *
+ * 参数说明：
+ *
+ *   sample：       libsensor 传给 dp_sample_func_t 或 dp_batch_func_t 的采样值
+ *
+ *   context：      sensor application 的数据
+ *
+ *   free_context： 释放 context 的函数，可以为 NULL
+ *
+ * 返回值：
+ *
+ *    0：成功
+ *
+ *   -1：sample 不属于任何数据点
+ */
+int lib_sensor_set_context(const struct lib_sensor_sample *sample, void *context, void (*free_context)(void *));
+
+/**
+ * libsensor 提供的辅助函数
+ *
+ * file 类型的采样值不写入文件，而由内存中的 fd（例如 memfd）提供内容，上传时直接从 fd 读取，
+ * 不经过 flash。sensor application 仍须将文件名写入 value.file，用于上传路径和发给设备代理端的数据，
+ * 但不创建该文件。fd 归 libsensor 所有，上传后或采集失败时关闭。配置文件设置了 uploadSpool 时，
+ * 这样的文件也不写入 spool 目录。
+ *
+ * 参数说明：
+ *
+ *   sample：  libsensor 传给 dp_sample_func_t 或 dp_batch_func_t 的 file 类型的采样值
+ *
+ *   fd：      文件内容，从偏移 0 读到末尾，可以是 0
+ *
+ * 返回值：
+ *
+ *    0：成功
+ *
+ *   -1：fd 小于 0，或 sample 不属于任何数据点或不是 file 类型，此时 fd 已被关闭
+ */
+int lib_sensor_file_fd(struct lib_sensor_sample *sample, int fd);
+
+/**
+ * libsensor 提供的辅助函数
+ *
+ * 将 data 开始的 len 字节复制到 libsensor 创建的内存文件（memfd，内核不支持时为 /dev/shm 中的文件）
+ * 作为 file 类型采样值的内容，其余与 lib_sensor_file_fd 相同。仅限 Linux。
+ *
+ * 返回值：
+ *
+ *    0：成功
+ *
+ *   -1：失败，sensor application 可以改为写入文件
+ */
+int lib_sensor_file_data(struct lib_sensor_sample *sample, const void *data, size_t len);
+
 /**
  * libsensor 提供的辅助函数
  *
- * 根据给定的属性名称，从 Sensor Application 全局属性定义中取得对应的属性所定义的 int 类型数值
+ * 根据给定的属性名称，从默认实例的 Sensor Application 全局属性定义中取得对应的属性所定义的 int 类型数值
  *
  * 参数说明：
  *
@@ -141,7 +719,7 @@ int int_from_config_by_name(const char *name);
 /**
  * libsensor 提供的辅助函数
  *
- * 根据给定的数据点属性名称，取得对应的数据点属性所定义的 string 类型数值
+ * 根据给定的属性名称，从默认实例的 Sensor Application 全局属性定义中取得对应的属性所定义的 string 类型数值
  *
  * 参数说明：
  *
@@ -151,4 +729,38 @@ int int_from_config_by_name(const char *name);
  */
 const char *string_from_config_by_name(const char *name);
 
+/**
+ * libsensor 提供的辅助函数
+ *
+ * 与 int_from_config_by_name 相同，但从给定实例的全局属性定义中取值
+ *
+ * 参数说明：
+ *
+ *   ls：      libsensor 实例
+ *
+ *   name：    全局（global）属性名称
+ *
+ * 返回值： 指向属性名称所对应数值
+ */
+int lib_sensor_config_int(lib_sensor_t *ls, const char *name);
+
+/**
+ * libsensor 提供的辅助函数
+ *
+ * 与 string_from_config_by_name 相同，但从给定实例的全局属性定义中取值
+ *
+ * 参数说明：
+ *
+ *   ls：      libsensor 实例
+ *
+ *   name：    全局（global）属性名称
+ *
+ * 返回值： 指向属性名称所对应字符串的指针
+ */
+const char *lib_sensor_config_string(lib_sensor_t *ls, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* __LIB_SENSOR_H */
@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2015, www.easyiot.com.cn
+ *
+ * The right to copy, distribute, modify, or otherwise make use
+ * of this software may be licensed only pursuant to the terms
+ * of an applicable license agreement.
+ *
+ */
+
+#ifndef __LIB_SENSOR_HPP
+#define __LIB_SENSOR_HPP
+
+/**
+ * libsensor 的 C++ 封装，只有头文件，需要 C++11。
+ *
+ * 每种设备实现为一个驱动类型，例如：
+ *
+ *   struct temperature {
+ *       static const char *name() { return "temperature"; }
+ *
+ *       std::string mbdev;
+ *       int addr;
+ *
+ *       void bind(libsensor::binder<temperature> &b) {
+ *           b.prop("mbdev", &temperature::mbdev).prop("addr", &temperature::addr);
+ *       }
+ *
+ *       int sample(lib_sensor_sample &s) {
+ *           s.value.numeric = read_modbus(mbdev, addr);
+ *           return 0;
+ *       }
+ *   };
+ *
+ *   libsensor::sensor<temperature, humidity> app("smartfarm.json");
+ *   app.run();
+ *
+ * 数据点的 name 属性与驱动类型的 name() 相同时由该驱动采集。每个数据点第一次采集时（以及属性变化后）
+ * 创建一个驱动对象，并通过 bind 将属性转换后写入其成员，之后的采集直接调用该对象的 sample，
+ * 不再有按名称查找和字符串比较。驱动类型缺少 name() 或 sample()，或者绑定了不支持的成员类型时，编译时报错。
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "lib_sensor.h"
+
+namespace libsensor {
+
+/**
+ * 将数据点属性绑定到驱动对象的成员，驱动类型的 bind 函数通过它声明要读取的属性。
+ * 支持 int、long、double、bool 与 std::string 类型的成员，属性不存在时成员保持原值。
+ */
+template <typename D>
+class binder {
+public:
+	binder(D &drv, void *props) : drv_(drv), props_(props) {}
+
+	/* the member may be one D inherits */
+	template <typename T, typename B>
+	binder &prop(const char *name, T B::*member)
+	{
+		static_assert(std::is_base_of<B, D>::value, "libsensor::binder: not a member of the driver");
+		if (get_node_by_name(props_, name) != NULL)
+			assign(drv_.*member, name);
+		return *this;
+	}
+
+private:
+	template <typename T>
+	void assign(T &, const char *)
+	{
+		static_assert(sizeof(T) == 0, "libsensor::binder: unsupported member type");
+	}
+
+	void assign(int &v, const char *name) { v = get_int_by_name(props_, name); }
+	void assign(long &v, const char *name) { v = get_int_by_name(props_, name); }
+	void assign(double &v, const char *name) { v = get_double_by_name(props_, name); }
+
+	void assign(bool &v, const char *name)
+	{
+		const char *s = get_string_by_name(props_, name);
+
+		v = s != NULL && (std::strcmp(s, "true") == 0 || std::atoi(s) != 0);
+	}
+
+	void assign(std::string &v, const char *name)
+	{
+		const char *s = get_string_by_name(props_, name);
+
+		v = s != NULL ? s : "";
+	}
+
+	D &drv_;
+	void *props_;
+};
+
+namespace detail {
+
+template <typename D>
+class is_driver {
+	template <typename T>
+	static auto check(int) -> decltype(
+		static_cast<int>(std::declval<T &>().sample(std::declval<lib_sensor_sample &>())),
+		static_cast<const char *>(T::name()),
+		std::true_type());
+	template <typename>
+	static std::false_type check(...);
+public:
+	static const bool value = decltype(check<D>(0))::value;
+};
+
+template <typename D>
+class has_bind {
+	template <typename T>
+	static auto check(int) -> decltype(
+		std::declval<T &>().bind(std::declval<binder<T> &>()),
+		std::true_type());
+	template <typename>
+	static std::false_type check(...);
+public:
+	static const bool value = decltype(check<D>(0))::value;
+};
+
+template <typename... Ds>
+struct all_drivers : std::true_type {};
+
+template <typename D, typename... Ds>
+struct all_drivers<D, Ds...>
+	: std::integral_constant<bool, is_driver<D>::value && all_drivers<Ds...>::value> {};
+
+template <typename D>
+void bind(D &drv, void *props, std::true_type)
+{
+	binder<D> b(drv, props);
+
+	drv.bind(b);
+}
+
+template <typename D>
+void bind(D &, void *, std::false_type)
+{
+}
+
+/* the driver object of a datapoint, kept as its context */
+struct slot {
+	virtual ~slot() {}
+	virtual int sample(lib_sensor_sample &s) = 0;
+
+	static void destroy(void *p) { delete static_cast<slot *>(p); }
+};
+
+template <typename D>
+struct driver_slot : slot {
+	D drv;
+
+	int sample(lib_sensor_sample &s) { return drv.sample(s); }
+};
+
+/* datapoints no driver matches, so they are not resolved again */
+struct no_driver : slot {
+	int sample(lib_sensor_sample &) { return -1; }
+};
+
+template <typename... Ds>
+struct resolver {
+	static slot *resolve(const char *, void *) { return NULL; }
+};
+
+template <typename D, typename... Ds>
+struct resolver<D, Ds...> {
+	static slot *resolve(const char *name, void *props)
+	{
+		if (std::strcmp(name, D::name()) != 0)
+			return resolver<Ds...>::resolve(name, props);
+
+		driver_slot<D> *s = new driver_slot<D>();
+		bind(s->drv, props, std::integral_constant<bool, has_bind<D>::value>());
+		return s;
+	}
+};
+
+} /* namespace detail */
+
+/**
+ * libsensor 实例，构造时创建，析构时销毁。Drivers 为该实例的全部驱动类型。
+ */
+template <typename... Drivers>
+class sensor {
+	static_assert(detail::all_drivers<Drivers...>::value,
+		"libsensor::sensor: a driver needs static const char *name() and int sample(lib_sensor_sample &)");
+
+public:
+	/**
+	 * 参数说明与 lib_sensor_create 相同，失败时抛出 std::runtime_error。
+	 */
+	explicit sensor(const char *cfg_file, set_dp_func_t *set_dp_func = NULL, void *data = NULL)
+		: ls_(NULL), opened_(false)
+	{
+		name_prop();
+		ls_ = lib_sensor_create(cfg_file, &sample_func, set_dp_func, data);
+		if (ls_ == NULL)
+			throw std::runtime_error("lib_sensor_create failed");
+	}
+
+	~sensor()
+	{
+		if (opened_)
+			lib_sensor_close(ls_);
+		lib_sensor_destroy(ls_);
+	}
+
+	int run() { return lib_sensor_run(ls_); }
+	void stop() { lib_sensor_stop(ls_); }
+
+	int open()
+	{
+		int ret = lib_sensor_open(ls_);
+
+		opened_ = true;
+		return ret;
+	}
+
+	int get_fd() { return lib_sensor_get_fd(ls_); }
+	int next_timeout() { return lib_sensor_next_timeout(ls_); }
+	int dispatch() { return lib_sensor_dispatch(ls_); }
+
+	void close()
+	{
+		if (opened_)
+			lib_sensor_close(ls_);
+		opened_ = false;
+	}
+
+	lib_sensor_t *get() const { return ls_; }
+
+private:
+	sensor(const sensor &);
+	sensor &operator=(const sensor &);
+
+	static lib_sensor_prop_t name_prop()
+	{
+		static const lib_sensor_prop_t prop = lib_sensor_prop("name");
+
+		return prop;
+	}
+
+	static int sample_func(void *props, lib_sensor_sample *sample)
+	{
+		static detail::no_driver none;
+		detail::slot *s = static_cast<detail::slot *>(lib_sensor_context(sample));
+
+		try {
+			if (s == NULL) {
+				const char *name = lib_sensor_prop_string(sample, name_prop());
+				std::unique_ptr<detail::slot> p(name != NULL ? detail::resolver<Drivers...>::resolve(name, props) : NULL);
+
+				if (!p) {
+					lib_sensor_set_context(sample, &none, NULL);
+					return -1;
+				}
+				/* not kept if the sample has no datapoint to keep it on */
+				if (lib_sensor_set_context(sample, p.get(), &detail::slot::destroy) < 0)
+					return p->sample(*sample);
+				s = p.release();
+			}
+			return s->sample(*sample);
+		} catch (...) {
+			/* exceptions must not unwind into the C library */
+			return -1;
+		}
+	}
+
+	lib_sensor_t *ls_;
+	bool opened_;
+};
+
+} /* namespace libsensor */
+
+#endif /* __LIB_SENSOR_HPP */
@@ -0,0 +1,1538 @@
+/*
+ * Copyright (C) 2015, www.easyiot.com.cn
+ *
+ * The right to copy, distribute, modify, or otherwise make use
+ * of this software may be licensed only pursuant to the terms
+ * of an applicable license agreement.
+ *
+ */
+
+#define _GNU_SOURCE // required by asprintf
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _MSC_VER
+#include <Winsock2.h>
+#include <Ws2tcpip.h>
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#endif
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "upload.h"
+
+#define MAXLINE 256
+
+#define DNS_ADDR_MAX 4		/* addresses kept per host */
+#define DNS_RETRY 10		/* seconds before a failed lookup is tried again */
+
+#define SHAPE_BURST_MIN (4 << 10)	/* bytes, see shape_take() */
+#define THROTTLE_MAX 4		/* the rate is halved at most this many times */
+#define THROTTLE_STEP 1000	/* ms between two changes of the throttle level */
+#define SPOOL_COMPACT 64	/* index records beyond two per file before it is rewritten */
+#define SPOOL_BACKOFF_MIN 5	/* seconds before a failed file is tried again, doubled per attempt */
+#define SPOOL_BACKOFF_MAX 300
+
+/* file body copied through user space where sendfile() can not be used */
+#define UPLOAD_BUF_SIZE (64 << 10)
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifdef _MSC_VER
+#define strncasecmp _strnicmp
+typedef SSIZE_T ssize_t;
+int asprintf(char **strp, const char *fmt, ...);	/* see lib_sensor.c */
+#else
+/* a Winsock socket is not a file descriptor */
+#define closesocket close
+#endif
+
+/*
+ * Uploads run on a fixed set of worker threads fed by a bounded queue, so
+ * the number of threads and the memory they take stay the same however
+ * far the uploads fall behind. Files of higher priority are taken first.
+ * When the queue is full the oldest or the newest file of the lowest
+ * priority is dropped, see enum upload_overflow. With a spool the queue
+ * is bounded by its quota instead.
+ */
+struct upload_pool {
+#ifndef _MSC_VER
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t *workers;
+
+	/* the resolver thread, see dns_lookup() */
+	pthread_cond_t dns_cond, dns_done;
+	pthread_t resolver;
+	int resolver_started;
+#endif
+	int nworkers;
+	struct list_head queues[UPLOAD_PRIO_MAX];	/* one per enum upload_priority */
+	int queued;		/* files in the queues that are not in the spool */
+	struct upload_options opts;
+
+	/* token bucket and agent latency, see shape_take() */
+#ifndef _MSC_VER
+	pthread_cond_t shape_cond;
+#endif
+	long long tokens, tokens_t;
+	int throttle;
+	long long throttle_t;
+	struct list_head dns;	/* struct dns_entry */
+
+	/* the spool, see spool_open() */
+	struct list_head spool;	/* struct upload_info, oldest first */
+	char *spool_index;
+	int spool_fd;		/* the index, -1 without a spool */
+	int spool_files, spool_records;
+	long long spool_bytes;
+	long long spool_seq;	/* of the newest file */
+	int quit;
+};
+
+/*
+ * The addresses of a host, shared by all workers of a pool. Once they are
+ * older than the TTL the resolver thread looks them up again, the old ones
+ * are used until it is done and kept if the lookup fails.
+ */
+struct dns_entry {
+	struct list_head list;
+	char *host;
+	struct sockaddr_storage addr[DNS_ADDR_MAX];
+	socklen_t addrlen[DNS_ADDR_MAX];
+	int naddr;
+	long long expires;	/* ms, see now_ms() */
+	int pending;		/* waiting for the resolver thread */
+	int resolved;		/* looked up at least once */
+};
+
+void upload_info_free(struct upload_info *upinfo)
+{
+	if (upinfo->free_data != NULL)
+		upinfo->free_data(upinfo->data);
+	if (upinfo->host != NULL)
+		free(upinfo->host);
+	if (upinfo->url != NULL)
+		free(upinfo->url);
+	if (upinfo->file != NULL)
+		free(upinfo->file);
+	if (upinfo->memfd >= 0)
+		close(upinfo->memfd);
+	free(upinfo);
+}
+
+/*
+ * Done with a file, uploaded or not: remove it unless it is in memory.
+ */
+static void upload_release(struct upload_info *upinfo)
+{
+	if (upinfo->memfd < 0)
+		remove(upinfo->file);
+	upload_info_free(upinfo);
+}
+
+/*
+ * A file that will not be uploaded, it is removed like after a failed upload.
+ */
+static void upload_drop(struct upload_info *upinfo)
+{
+	printf("upload of %s dropped\n", upinfo->file);
+	upload_release(upinfo);
+}
+
+/*
+ * XXH64 of a file, read in UPLOAD_BUF_SIZE blocks. Words are read in host
+ * order, the targets are all little endian.
+ */
+#define PRIME64_1 11400714785074694791ULL
+#define PRIME64_2 14029467366897019727ULL
+#define PRIME64_3 1609587929392839161ULL
+#define PRIME64_4 9650029242287828579ULL
+#define PRIME64_5 2870177450012600261ULL
+
+static unsigned long long rotl64(unsigned long long x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static unsigned long long xxh64_round(unsigned long long acc, const unsigned char *p)
+{
+	unsigned long long v;
+
+	memcpy(&v, p, 8);
+	acc += v * PRIME64_2;
+	return rotl64(acc, 31) * PRIME64_1;
+}
+
+static unsigned long long xxh64_merge(unsigned long long h, unsigned long long v)
+{
+	h ^= rotl64(v * PRIME64_2, 31) * PRIME64_1;
+	return h * PRIME64_1 + PRIME64_4;
+}
+
+int upload_hash(const char *file, int fd, unsigned long long *hash, long long *size)
+{
+	unsigned long long v[4] = { PRIME64_1 + PRIME64_2, PRIME64_2, 0, 0 - PRIME64_1 };
+	unsigned long long h, total = 0;
+	unsigned int w;
+	unsigned char *buf, *p;
+	size_t len = 0;
+	int n, i;
+
+	fd = fd >= 0 ? dup(fd) : open(file, O_RDONLY | O_BINARY);
+	if (fd < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	buf = malloc(UPLOAD_BUF_SIZE);
+	if (buf == NULL) {
+		close(fd);
+		return -1;
+	}
+	/* whole 32 byte stripes go into v[], the rest waits for the next block */
+	while ((n = read(fd, buf + len, UPLOAD_BUF_SIZE - len)) > 0) {
+		total += n;
+		len += n;
+		for (p = buf; buf + len - p >= 32; p += 32)
+			for (i = 0; i < 4; i++)
+				v[i] = xxh64_round(v[i], p + i * 8);
+		len -= p - buf;
+		memmove(buf, p, len);
+	}
+	close(fd);
+	if (n < 0) {
+		free(buf);
+		return -1;
+	}
+
+	if (total >= 32) {
+		h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+		for (i = 0; i < 4; i++)
+			h = xxh64_merge(h, v[i]);
+	} else {
+		h = PRIME64_5;
+	}
+	h += total;
+	for (p = buf; len >= 8; p += 8, len -= 8) {
+		h ^= xxh64_round(0, p);
+		h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+	}
+	if (len >= 4) {
+		memcpy(&w, p, 4);
+		h ^= w * PRIME64_1;
+		h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+		len -= 4;
+	}
+	for (; len > 0; p++, len--) {
+		h ^= *p * PRIME64_5;
+		h = rotl64(h, 11) * PRIME64_1;
+	}
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	free(buf);
+
+	*hash = h;
+	*size = total;
+	return 0;
+}
+
+/*
+ * A connection to the cloud server kept open between uploads, each worker
+ * has its own. It is closed when the server asks for it, on any error,
+ * and after the idle timeout of the pool without uploads.
+ */
+struct upload_conn {
+	char *host;
+	int port;
+	int fd;
+	long long last_used;	/* ms, see now_ms() */
+};
+
+#define UPLOAD_CONN_INIT { NULL, 0, -1, 0 }
+
+static long long now_ms(void)
+{
+#ifdef _MSC_VER
+	return GetTickCount64();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+static void conn_close(struct upload_conn *conn)
+{
+	if (conn->fd >= 0)
+		closesocket(conn->fd);
+	conn->fd = -1;
+	if (conn->host != NULL)
+		free(conn->host);
+	conn->host = NULL;
+}
+
+static int dns_resolve(const char *host, struct sockaddr_storage *addr, socklen_t *addrlen)
+{
+	struct addrinfo hints, *res, *ai;
+	int n = 0, err;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	err = getaddrinfo(host, NULL, &hints, &res);
+	if (err != 0) {
+		printf("getaddrinfo error for host %s: %s\n", host, gai_strerror(err));
+		return -1;
+	}
+	for (ai = res; ai != NULL && n < DNS_ADDR_MAX; ai = ai->ai_next) {
+		memcpy(&addr[n], ai->ai_addr, ai->ai_addrlen);
+		addrlen[n++] = ai->ai_addrlen;
+	}
+	freeaddrinfo(res);
+	return n;
+}
+
+#ifndef _MSC_VER
+static void *dns_thread(void *arg)
+{
+	struct upload_pool *pool = arg;
+	struct sockaddr_storage addr[DNS_ADDR_MAX];
+	socklen_t addrlen[DNS_ADDR_MAX];
+	struct dns_entry *e, *it;
+	int n;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->quit) {
+		e = NULL;
+		list_for_each_entry(it, &pool->dns, list) {
+			if (it->pending) {
+				e = it;
+				break;
+			}
+		}
+		if (e == NULL) {
+			pthread_cond_wait(&pool->dns_cond, &pool->lock);
+			continue;
+		}
+		/* entries stay until the pool is destroyed, after this thread */
+		pthread_mutex_unlock(&pool->lock);
+		n = dns_resolve(e->host, addr, addrlen);
+		pthread_mutex_lock(&pool->lock);
+
+		if (n > 0) {
+			memcpy(e->addr, addr, sizeof(addr));
+			memcpy(e->addrlen, addrlen, sizeof(addrlen));
+			e->naddr = n;
+			e->expires = now_ms() + pool->opts.dns_ttl * 1000LL;
+		} else {
+			/* keep the last good addresses */
+			e->expires = now_ms() + DNS_RETRY * 1000LL;
+		}
+		e->pending = 0;
+		e->resolved = 1;
+		pthread_cond_broadcast(&pool->dns_done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static struct dns_entry *dns_find(struct upload_pool *pool, const char *host)
+{
+	struct dns_entry *e;
+
+	list_for_each_entry(e, &pool->dns, list) {
+		if (strcmp(e->host, host) == 0)
+			return e;
+	}
+	return NULL;
+}
+#endif
+
+/*
+ * Copy the addresses of 'host' to 'addr' with 'port' filled in, return
+ * how many or -1. Expired addresses are looked up again in the background,
+ * only the first lookup of a host is waited for.
+ */
+static int dns_lookup(struct upload_pool *pool, const char *host, int port,
+	struct sockaddr_storage *addr, socklen_t *addrlen)
+{
+	int i, n;
+#ifdef _MSC_VER
+	n = dns_resolve(host, addr, addrlen);
+#else
+	struct dns_entry *e;
+
+	pthread_mutex_lock(&pool->lock);
+	e = dns_find(pool, host);
+	if (e == NULL) {
+		e = calloc(1, sizeof(*e));
+		if (e == NULL || (e->host = strdup(host)) == NULL) {
+			pthread_mutex_unlock(&pool->lock);
+			free(e);
+			return -1;
+		}
+		list_add_tail(&e->list, &pool->dns);
+	}
+	if (!e->pending && now_ms() >= e->expires) {
+		e->pending = 1;
+		pthread_cond_signal(&pool->dns_cond);
+	}
+	while (!e->resolved && !pool->quit)
+		pthread_cond_wait(&pool->dns_done, &pool->lock);
+	n = e->naddr;
+	memcpy(addr, e->addr, n * sizeof(*addr));
+	memcpy(addrlen, e->addrlen, n * sizeof(*addrlen));
+	pthread_mutex_unlock(&pool->lock);
+#endif
+	for (i = 0; i < n; i++) {
+		if (addr[i].ss_family == AF_INET6)
+			((struct sockaddr_in6 *)&addr[i])->sin6_port = htons(port);
+		else
+			((struct sockaddr_in *)&addr[i])->sin_port = htons(port);
+	}
+	return n > 0 ? n : -1;
+}
+
+/* none of the addresses of 'host' took a connection, look it up again */
+static void dns_invalidate(struct upload_pool *pool, const char *host)
+{
+#ifndef _MSC_VER
+	struct dns_entry *e;
+
+	pthread_mutex_lock(&pool->lock);
+	e = dns_find(pool, host);
+	if (e != NULL)
+		e->expires = 0;
+	pthread_mutex_unlock(&pool->lock);
+#endif
+}
+
+/*
+ * Make sure 'conn' is connected to the server of 'upinfo'. Returns 1 if an
+ * open connection is reused, 0 if a new one was made and -1 on errors.
+ */
+static int conn_open(struct upload_pool *pool, struct upload_conn *conn, struct upload_info *upinfo)
+{
+	struct sockaddr_storage addr[DNS_ADDR_MAX];
+	socklen_t addrlen[DNS_ADDR_MAX];
+	int i, n;
+
+	if (conn->fd >= 0 && conn->port == upinfo->port && strcmp(conn->host, upinfo->host) == 0
+		&& now_ms() - conn->last_used < pool->opts.idle_timeout * 1000LL)
+		return 1;
+	conn_close(conn);
+
+	n = dns_lookup(pool, upinfo->host, upinfo->port, addr, addrlen);
+	if (n < 0)
+		return -1;
+
+	/* a socket that failed to connect can not be used again */
+	for (i = 0; i < n; i++) {
+		conn->fd = socket(addr[i].ss_family, SOCK_STREAM, 0);
+		if (conn->fd < 0) {
+			fprintf(stderr, "create socket error: %d\n", errno);
+			continue;
+		}
+		while (connect(conn->fd, (struct sockaddr *)&addr[i], addrlen[i]) < 0) {
+			if (EINPROGRESS != errno) {
+				closesocket(conn->fd);
+				conn->fd = -1;
+				break;
+			}
+		}
+		if (conn->fd >= 0)
+			break;
+	}
+	if (conn->fd < 0) {
+		fprintf(stderr, "connect to server error: %d\n", errno);
+		dns_invalidate(pool, upinfo->host);
+		return -1;
+	}
+	conn->host = strdup(upinfo->host);
+	if (conn->host == NULL) {
+		conn_close(conn);
+		return -1;
+	}
+	conn->port = upinfo->port;
+	return 0;
+}
+
+static int send_all(int fd, const char *buf, size_t len, int flags)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(fd, buf, len, flags | MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Wait until the next bytes of an upload may go out and return how many of
+ * 'want' may. All uploads of the pool share a token bucket filled at
+ * upload_options.rate, holding up to a quarter second of it. Each throttle
+ * level, see upload_report_latency(), halves the rate.
+ */
+static long long shape_take(struct upload_pool *pool, long long want)
+{
+#ifdef _MSC_VER
+	return want;
+#else
+	long long now, rate, burst, grant, add;
+	struct timespec ts;
+
+	if (pool->opts.rate <= 0)
+		return want;
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		/* the last upload goes out as fast as it can */
+		grant = want;
+		if (pool->quit)
+			break;
+		now = now_ms();
+		rate = pool->opts.rate >> pool->throttle;
+		if (rate <= 0)
+			rate = 1;
+		burst = rate / 4 > SHAPE_BURST_MIN ? rate / 4 : SHAPE_BURST_MIN;
+		add = (now - pool->tokens_t) * rate / 1000;
+		if (add > 0) {
+			pool->tokens += add;
+			pool->tokens_t = now;
+		}
+		if (pool->tokens > burst)
+			pool->tokens = burst;
+		if (grant > burst)
+			grant = burst;
+		if (pool->tokens >= grant) {
+			pool->tokens -= grant;
+			break;
+		}
+		now += (grant - pool->tokens) * 1000 / rate + 1;
+		ts.tv_sec = now / 1000;
+		ts.tv_nsec = now % 1000 * 1000000;
+		pthread_cond_timedwait(&pool->shape_cond, &pool->lock, &ts);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return grant;
+#endif
+}
+
+/*
+ * Send exactly the bytes 'off' up to 'end' of 'fd', the Content-length of
+ * the request, as fast as shape_take() lets it. Returns -1 if the send
+ * failed or the file ended early, the connection can not be used further
+ * then.
+ */
+static int send_body(struct upload_pool *pool, struct upload_info *upinfo, int sock, int fd,
+	long long off, long long end)
+{
+	long long slice_end;
+	char *buf = NULL;
+	ssize_t n;
+#ifndef _MSC_VER
+	int copy = 0;
+	off_t pos;
+#endif
+
+	while (off < end) {
+		slice_end = off + shape_take(pool, end - off);
+		while (off < slice_end) {
+#ifndef _MSC_VER
+			if (!copy) {
+				/* the kernel moves the file straight to the socket */
+				pos = off;
+				n = sendfile(sock, fd, &pos, slice_end - off);
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+					copy = 1;	/* not supported for this file */
+					continue;
+				}
+				if (n <= 0)
+					goto fail;
+				off = pos;
+				continue;
+			}
+#endif
+			if (buf == NULL && (buf = malloc(UPLOAD_BUF_SIZE)) == NULL)
+				goto fail;
+			if (lseek(fd, off, SEEK_SET) < 0)
+				goto fail;
+			n = read(fd, buf, slice_end - off < UPLOAD_BUF_SIZE ? slice_end - off : UPLOAD_BUF_SIZE);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0 || send_all(sock, buf, n, 0) < 0)
+				goto fail;
+			off += n;
+		}
+	}
+	free(buf);
+	return 0;
+
+fail:
+	free(buf);
+	return -1;
+}
+
+/* the value of header 'name' in the response header 'hdr', or NULL */
+static const char *find_header(const char *hdr, const char *name)
+{
+	size_t len = strlen(name);
+	const char *p;
+
+	for (p = strstr(hdr, "\r\n"); p != NULL; p = strstr(p, "\r\n")) {
+		p += 2;
+		if (strncasecmp(p, name, len) == 0 && p[len] == ':') {
+			p += len + 1;
+			while (*p == ' ' || *p == '\t')
+				p++;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Read a response off 'conn' and return its status code, or -1 on errors.
+ * The body is read by its Content-Length and dropped, so the next request
+ * can go on the same connection. '*keep' tells whether it may. '*acked'
+ * is the number of bytes the Range header of a 308 says the server has.
+ */
+static int read_response(struct upload_conn *conn, int *keep, long long *acked)
+{
+	char hdr[MAXLINE * 4 + 1];
+	size_t len = 0, left;
+	const char *end, *v;
+	int status, minor;
+	long clen = -1;
+	ssize_t n;
+
+	*keep = 0;
+	*acked = 0;
+	for (;;) {
+		if (len == sizeof(hdr) - 1) {
+			fprintf(stderr, "response header too long\n");
+			return -1;
+		}
+		n = recv(conn->fd, hdr + len, sizeof(hdr) - 1 - len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		len += n;
+		hdr[len] = '\0';
+		end = strstr(hdr, "\r\n\r\n");
+		if (end != NULL)
+			break;
+	}
+#if 0
+	/* dump out received header */
+	printf("%.*s", (int)(end - hdr), hdr);
+#endif
+	if (sscanf(hdr, "HTTP/1.%d %d", &minor, &status) != 2)
+		return -1;
+
+	/* HTTP/1.1 keeps the connection unless told otherwise, HTTP/1.0 closes it */
+	v = find_header(hdr, "Connection");
+	*keep = v != NULL ? strncasecmp(v, "close", 5) != 0 : minor >= 1;
+
+	/* "bytes=0-N", the server has N + 1 bytes in a row */
+	v = find_header(hdr, "Range");
+	if (v != NULL && strncmp(v, "bytes=0-", 8) == 0)
+		*acked = atoll(v + 8) + 1;
+
+	v = find_header(hdr, "Content-Length");
+	if (v != NULL)
+		clen = atol(v);
+	else if (status == 204 || status == 304 || status / 100 == 1)
+		clen = 0;
+	else
+		*keep = 0;	/* the body runs until the server closes */
+
+	/* drop the body, part of it may have come with the header */
+	left = len - (end + 4 - hdr);
+	if (*keep && clen >= 0) {
+		if ((long)left > clen) {
+			/* more than the response, the connection is out of step */
+			*keep = 0;
+		} else {
+			clen -= left;
+			while (clen > 0) {
+				n = recv(conn->fd, hdr, clen < (long)sizeof(hdr) ? clen : (long)sizeof(hdr), 0);
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n <= 0) {
+					*keep = 0;
+					break;
+				}
+				clen -= n;
+			}
+		}
+	}
+	return status;
+}
+
+/*
+ * Send one PUT of the bytes 'off' up to 'end' of the file, a chunk if
+ * 'chunked', and return the status of the response or -1. A chunk with
+ * 'off' equal to 'end' asks the server how far it has got.
+ */
+static int put_range(struct upload_pool *pool, struct upload_conn *conn, struct upload_info *upinfo, int fd,
+	long long off, long long end, long long size, int chunked, long long *acked)
+{
+	char range[80] = "";
+	char *sendline;
+	int ret, keep = 0;
+
+	if (chunked && off < end)
+		snprintf(range, sizeof(range), "Content-Range: bytes %lld-%lld/%lld\r\n", off, end - 1, size);
+	else if (chunked)
+		snprintf(range, sizeof(range), "Content-Range: bytes */%lld\r\n", size);
+
+	if (asprintf(&sendline,
+		"PUT %s HTTP/1.1\r\n"
+		"HOST: %s\r\n"
+		"Connection: keep-alive\r\n"
+		"Content-type: application/octet-stream\r\n"
+		"%s"
+		"Content-length: %lld\r\n\r\n"
+		, upinfo->url, upinfo->host, range, end - off) < 0) {
+		fprintf(stderr, "memory exhausted.\n");
+		return -1;
+	}
+
+	/* the header goes out in the same segment as the start of the body */
+	ret = -1;
+	if (send_all(conn->fd, sendline, strlen(sendline), end > off ? MSG_MORE : 0) == 0
+		&& send_body(pool, upinfo, conn->fd, fd, off, end) == 0)
+		ret = read_response(conn, &keep, acked);
+	free(sendline);
+
+	if (ret < 0 || !keep)
+		conn_close(conn);
+	return ret;
+}
+
+/*
+ * Upload a file in one PUT, or in chunks of upinfo->chunk_size bytes for
+ * larger files. The server acknowledges each chunk with "308 Resume
+ * Incomplete" and the Range it has, and "204 No Content" once the file
+ * is complete. After a failed chunk the server is asked for its Range and
+ * the upload goes on from there. Only tries without progress count
+ * against upinfo->retry.
+ */
+static int http_putfile(struct upload_pool *pool, struct upload_info *upinfo, struct upload_conn *conn)
+{
+	struct stat st;
+	int fd, i, status, reused, chunked, stale = 1;
+	long long off, end, acked, acked_max = 0;
+	int uploaded = 0;
+
+	fd = upinfo->memfd >= 0 ? dup(upinfo->memfd) : open(upinfo->file, O_RDONLY | O_BINARY);
+	if (fd < 0) {
+		printf("Fail to read file: %s\n", upinfo->file);
+		goto cleanup;
+	}
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "fstat error: %d\n", errno);
+		goto cleanup;
+	}
+	chunked = upinfo->chunk_size > 0 && st.st_size > upinfo->chunk_size;
+
+	off = 0;
+	for (i = 0; i < upinfo->retry && !uploaded; i++) {
+		reused = conn_open(pool, conn, upinfo);
+		if (reused < 0)
+			continue;
+
+		/* off < 0: where to go on is up to the server */
+		if (off < 0) {
+			status = put_range(pool, conn, upinfo, fd, 0, 0, st.st_size, 1, &acked);
+			if (status == 308)
+				off = acked;
+			else if (status > 0 && status != 204)
+				off = 0;	/* the server does not know the upload */
+			if (status == 308 && acked <= acked_max)
+				i--;	/* only asked, not a try */
+		} else {
+			end = chunked && st.st_size - off > upinfo->chunk_size ? off + upinfo->chunk_size : st.st_size;
+			status = put_range(pool, conn, upinfo, fd, off, end, st.st_size, chunked, &acked);
+			if (status == 308 && chunked)
+				off = acked;
+			else if (status != 204 && chunked)
+				off = -1;
+		}
+		if (status == 204) {
+			uploaded = 1;
+		} else if (status == 308 && acked > acked_max) {
+			acked_max = acked;
+			i = -1;		/* progress, the tries start over */
+		} else if (status < 0 && reused && stale) {
+			/* the server may have closed an idle connection just now */
+			stale = 0;
+			i--;
+		}
+		if (conn->fd >= 0 && pool->opts.idle_timeout <= 0)
+			conn_close(conn);
+		else if (conn->fd >= 0)
+			conn->last_used = now_ms();
+	}
+
+cleanup:
+	if (fd >= 0)
+		close(fd);
+
+	return uploaded ? 0 : -1;
+}
+
+#ifdef _MSC_VER
+static DWORD WINAPI upload_thread(LPVOID arg)
+{
+	struct upload_info *upinfo = arg;
+	struct upload_conn conn = UPLOAD_CONN_INIT;
+	int ret;
+
+	if (upinfo->check == NULL || upinfo->check(upinfo) == 0) {
+		ret = http_putfile(upinfo->pool, upinfo, &conn);
+		if (upinfo->done != NULL)
+			upinfo->done(upinfo, ret);
+	}
+	conn_close(&conn);
+	upload_release(upinfo);
+	return 0;
+}
+#else
+/*
+ * The spool keeps files until they are uploaded, also across restarts.
+ * Submitted files are moved into the spool directory and recorded in its
+ * index, an append-only file of one record per line:
+ *
+ *   add <seq> <priority> <attempts> <size> <port> <retry> <chunk size> <host> <file> <url>
+ *   try <seq> <attempts>
+ *   del <seq>
+ *
+ * with the strings %-escaped. On start the index is replayed to queue the
+ * files again and rewritten with just those, so the directory itself is
+ * never scanned. A failed upload stays in the spool and is tried again
+ * later, files are only given up when the spool goes over its quota,
+ * oldest first.
+ */
+static char *spool_escape(const char *s)
+{
+	static const char hex[] = "0123456789abcdef";
+	char *buf = malloc(strlen(s) * 3 + 1), *p = buf;
+
+	if (buf == NULL)
+		return NULL;
+	for (; *s != '\0'; s++) {
+		if ((unsigned char)*s <= ' ' || *s == '%') {
+			*p++ = '%';
+			*p++ = hex[(unsigned char)*s >> 4];
+			*p++ = hex[*s & 15];
+		} else {
+			*p++ = *s;
+		}
+	}
+	*p = '\0';
+	return buf;
+}
+
+static void spool_unescape(char *s)
+{
+	char *p = s;
+	unsigned int c;
+
+	for (; *s != '\0'; s++) {
+		if (*s == '%' && sscanf(s + 1, "%2x", &c) == 1) {
+			*p++ = c;
+			s += 2;
+		} else {
+			*p++ = *s;
+		}
+	}
+	*p = '\0';
+}
+
+static char *spool_add_record(struct upload_info *upinfo)
+{
+	char *host = spool_escape(upinfo->host);
+	char *file = spool_escape(upinfo->file);
+	char *url = spool_escape(upinfo->url);
+	char *rec = NULL;
+
+	if (host != NULL && file != NULL && url != NULL
+		&& asprintf(&rec, "add %lld %d %d %lld %d %d %lld %s %s %s\n", upinfo->seq, upinfo->priority,
+			upinfo->attempts, upinfo->size, upinfo->port, upinfo->retry, upinfo->chunk_size,
+			host, file, url) < 0)
+		rec = NULL;
+	free(host);
+	free(file);
+	free(url);
+	return rec;
+}
+
+/*
+ * Rewrite the index with one "add" record per file in the spool.
+ */
+static int spool_compact(struct upload_pool *pool)
+{
+	struct upload_info *upinfo;
+	char *tmp = NULL, *rec;
+	ssize_t len;
+	int fd, ret = -1;
+
+	if (asprintf(&tmp, "%s.tmp", pool->spool_index) < 0)
+		return -1;
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		goto out;
+	list_for_each_entry(upinfo, &pool->spool, spool_list) {
+		rec = spool_add_record(upinfo);
+		len = rec != NULL ? (ssize_t)strlen(rec) : -1;
+		if (rec == NULL || write(fd, rec, len) != len) {
+			free(rec);
+			goto out;
+		}
+		free(rec);
+	}
+	if (fdatasync(fd) < 0 || rename(tmp, pool->spool_index) < 0)
+		goto out;
+	/* the new index is appended to from here on */
+	if (pool->spool_fd >= 0)
+		close(pool->spool_fd);
+	pool->spool_fd = fd;
+	pool->spool_records = pool->spool_files;
+	fd = -1;
+	ret = 0;
+out:
+	if (ret < 0) {
+		fprintf(stderr, "rewrite %s error: %s\n", pool->spool_index, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		unlink(tmp);
+	}
+	free(tmp);
+	return ret;
+}
+
+/*
+ * Append a record to the index. The spool has to be up to date with the
+ * record already, it may be rewritten here.
+ */
+static void spool_write(struct upload_pool *pool, const char *rec)
+{
+	ssize_t len = strlen(rec);
+
+	if (write(pool->spool_fd, rec, len) != len) {
+		fprintf(stderr, "write %s error: %s\n", pool->spool_index, strerror(errno));
+		return;
+	}
+	if (++pool->spool_records > 2 * pool->spool_files + SPOOL_COMPACT)
+		spool_compact(pool);
+}
+
+static struct upload_info *spool_find(struct upload_pool *pool, long long seq)
+{
+	struct upload_info *upinfo;
+
+	list_for_each_entry(upinfo, &pool->spool, spool_list)
+		if (upinfo->seq == seq)
+			return upinfo;
+	return NULL;
+}
+
+/*
+ * Move a file into the spool directory, copying it if that is on another
+ * file system.
+ */
+static int spool_move(const char *src, const char *dst)
+{
+	char *buf;
+	ssize_t n;
+	int in, out, ret = -1;
+
+	if (rename(src, dst) == 0)
+		return 0;
+	if (errno != EXDEV) {
+		fprintf(stderr, "rename %s error: %s\n", src, strerror(errno));
+		return -1;
+	}
+	buf = malloc(UPLOAD_BUF_SIZE);
+	in = open(src, O_RDONLY);
+	out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (buf != NULL && in >= 0 && out >= 0) {
+		while ((n = read(in, buf, UPLOAD_BUF_SIZE)) > 0)
+			if (write(out, buf, n) != n)
+				break;
+		if (n == 0 && fdatasync(out) == 0)
+			ret = 0;
+	}
+	if (ret < 0)
+		fprintf(stderr, "copy %s error: %s\n", src, strerror(errno));
+	if (in >= 0)
+		close(in);
+	if (out >= 0)
+		close(out);
+	free(buf);
+	if (ret < 0)
+		unlink(dst);
+	else
+		unlink(src);
+	return ret;
+}
+
+/*
+ * Move a submitted file into the spool directory, returns -1 if it stays
+ * where it is. Called without the pool lock, copying the file to another
+ * file system and syncing it may take a while.
+ */
+static int spool_move_in(struct upload_pool *pool, struct upload_info *upinfo)
+{
+	const char *name = strrchr(upinfo->file, '/');
+	long long seq = __sync_add_and_fetch(&pool->spool_seq, 1);
+	char *path = NULL;
+	struct stat st;
+
+	name = name != NULL ? name + 1 : upinfo->file;
+	if (stat(upinfo->file, &st) < 0
+		|| asprintf(&path, "%s/%lld-%s", pool->opts.spool_dir, seq, name) < 0)
+		return -1;
+	if (spool_move(upinfo->file, path) < 0) {
+		free(path);
+		return -1;
+	}
+	free(upinfo->file);
+	upinfo->file = path;
+	upinfo->seq = seq;
+	upinfo->size = st.st_size;
+	return 0;
+}
+
+/*
+ * Record a file moved in by spool_move_in(), with the pool lock held.
+ * Returns a descriptor of the index for the caller to sync and close once
+ * the lock is released, -1 if there is nothing to sync.
+ */
+static int spool_add(struct upload_pool *pool, struct upload_info *upinfo)
+{
+	char *rec;
+
+	list_add_tail(&upinfo->spool_list, &pool->spool);
+	pool->spool_files++;
+	pool->spool_bytes += upinfo->size;
+
+	/* without the record the file is still uploaded, but not after a restart */
+	rec = spool_add_record(upinfo);
+	if (rec == NULL)
+		return -1;
+	spool_write(pool, rec);
+	free(rec);
+	/* the index may be rewritten under another descriptor meanwhile */
+	return dup(pool->spool_fd);
+}
+
+/*
+ * The file is uploaded or given up, remove it from the spool.
+ */
+static void spool_forget(struct upload_pool *pool, struct upload_info *upinfo)
+{
+	char rec[64];
+
+	list_del(&upinfo->spool_list);
+	pool->spool_files--;
+	pool->spool_bytes -= upinfo->size;
+	snprintf(rec, sizeof(rec), "del %lld\n", upinfo->seq);
+	spool_write(pool, rec);
+	upload_release(upinfo);
+}
+
+/*
+ * The upload failed, queue the file again to be tried after a backoff.
+ */
+static void spool_retry(struct upload_pool *pool, struct upload_info *upinfo)
+{
+	char rec[64];
+	int backoff;
+
+	upinfo->attempts++;
+	backoff = upinfo->attempts > 7 ? SPOOL_BACKOFF_MAX : SPOOL_BACKOFF_MIN << (upinfo->attempts - 1);
+	if (backoff > SPOOL_BACKOFF_MAX)
+		backoff = SPOOL_BACKOFF_MAX;
+	upinfo->due = now_ms() + backoff * 1000LL;
+	snprintf(rec, sizeof(rec), "try %lld %d\n", upinfo->seq, upinfo->attempts);
+	spool_write(pool, rec);
+	list_add_tail(&upinfo->list, &pool->queues[upinfo->priority]);
+	printf("upload of %s failed %d times, next try in %d s\n", upinfo->file, upinfo->attempts, backoff);
+}
+
+/*
+ * Give up the oldest files not being uploaded until the spool is within
+ * its quota. Returns -1 if 'upinfo' was one of them.
+ */
+static int spool_evict(struct upload_pool *pool, struct upload_info *upinfo)
+{
+	struct upload_info *old, *tmp;
+	int ret = 0;
+
+	list_for_each_entry_safe(old, tmp, &pool->spool, spool_list) {
+		if (pool->opts.spool_quota <= 0 || pool->spool_bytes <= pool->opts.spool_quota)
+			break;
+		if (old->busy)
+			continue;
+		if (old == upinfo)
+			ret = -1;
+		printf("upload of %s dropped, spool over quota\n", old->file);
+		list_del(&old->list);
+		spool_forget(pool, old);
+	}
+	return ret;
+}
+
+/*
+ * Replay the index of the spool and queue the files in it again.
+ */
+static int spool_open(struct upload_pool *pool)
+{
+	struct upload_info *upinfo, *tmp;
+	char *line = NULL, *host, *file, *url;
+	size_t cap = 0;
+	ssize_t len;
+	struct stat st;
+	long long seq;
+	int attempts;
+	FILE *fp;
+
+	if (mkdir(pool->opts.spool_dir, 0755) < 0 && errno != EEXIST) {
+		fprintf(stderr, "mkdir %s error: %s\n", pool->opts.spool_dir, strerror(errno));
+		return -1;
+	}
+	if (asprintf(&pool->spool_index, "%s/index", pool->opts.spool_dir) < 0) {
+		pool->spool_index = NULL;
+		printf("Out of memory!");
+		return -1;
+	}
+
+	fp = fopen(pool->spool_index, "r");
+	while (fp != NULL && (len = getline(&line, &cap, fp)) > 0) {
+		/* a torn last line left by a crash is ignored */
+		if (line[len - 1] != '\n')
+			break;
+		if (sscanf(line, "try %lld %d", &seq, &attempts) == 2) {
+			upinfo = spool_find(pool, seq);
+			if (upinfo != NULL)
+				upinfo->attempts = attempts;
+		} else if (sscanf(line, "del %lld", &seq) == 1) {
+			upinfo = spool_find(pool, seq);
+			if (upinfo != NULL) {
+				list_del(&upinfo->spool_list);
+				upload_info_free(upinfo);
+			}
+		} else {
+			upinfo = calloc(1, sizeof(*upinfo));
+			if (upinfo == NULL)
+				break;
+			upinfo->memfd = -1;
+			host = file = url = NULL;
+			if (sscanf(line, "add %lld %d %d %lld %d %d %lld %ms %ms %ms", &upinfo->seq, &upinfo->priority,
+					&upinfo->attempts, &upinfo->size, &upinfo->port, &upinfo->retry,
+					&upinfo->chunk_size, &host, &file, &url) != 10) {
+				free(host);
+				free(file);
+				free(url);
+				free(upinfo);
+				continue;
+			}
+			spool_unescape(host);
+			spool_unescape(file);
+			spool_unescape(url);
+			upinfo->host = host;
+			upinfo->file = file;
+			upinfo->url = url;
+			list_add_tail(&upinfo->spool_list, &pool->spool);
+			if (upinfo->seq > pool->spool_seq)
+				pool->spool_seq = upinfo->seq;
+		}
+	}
+	free(line);
+	if (fp != NULL)
+		fclose(fp);
+
+	list_for_each_entry_safe(upinfo, tmp, &pool->spool, spool_list) {
+		if (stat(upinfo->file, &st) < 0) {
+			list_del(&upinfo->spool_list);
+			upload_info_free(upinfo);
+			continue;
+		}
+		if (upinfo->priority < 0 || upinfo->priority >= UPLOAD_PRIO_MAX)
+			upinfo->priority = UPLOAD_PRIO_NORMAL;
+		upinfo->size = st.st_size;
+		upinfo->pool = pool;
+		list_add_tail(&upinfo->list, &pool->queues[upinfo->priority]);
+		pool->spool_files++;
+		pool->spool_bytes += upinfo->size;
+	}
+	if (pool->spool_files > 0)
+		printf("%d files (%lld bytes) left to upload in %s\n", pool->spool_files,
+			pool->spool_bytes, pool->opts.spool_dir);
+
+	if (spool_compact(pool) < 0)
+		return -1;
+	spool_evict(pool, NULL);
+	return 0;
+}
+
+/*
+ * Take the next file to upload off the queues, highest priority first,
+ * skipping those waiting for a retry. Without one '*due' is when the
+ * next retry is, 0 if there is none. While the agent link is slow, low
+ * priority files are held back from the first throttle level and normal
+ * ones from the second, see upload_report_latency(); uploads already
+ * going on are not paused, only slowed down by shape_take().
+ */
+static struct upload_info *upload_next(struct upload_pool *pool, long long *due)
+{
+	struct upload_info *upinfo;
+	long long now = now_ms();
+	int prio;
+
+	*due = 0;
+	for (prio = 0; prio < UPLOAD_PRIO_MAX; prio++) {
+		if (prio != UPLOAD_PRIO_HIGH && pool->throttle >= UPLOAD_PRIO_MAX - prio)
+			break;
+		list_for_each_entry(upinfo, &pool->queues[prio], list) {
+			if (upinfo->due <= now) {
+				list_del(&upinfo->list);
+				if (upinfo->seq == 0)
+					pool->queued--;
+				upinfo->busy = 1;
+				return upinfo;
+			}
+			if (*due == 0 || upinfo->due < *due)
+				*due = upinfo->due;
+		}
+	}
+	return NULL;
+}
+
+static void *upload_worker(void *arg)
+{
+	struct upload_pool *pool = arg;
+	struct upload_conn conn = UPLOAD_CONN_INIT;
+	struct upload_info *upinfo;
+	int (*check)(struct upload_info *upinfo);
+	struct timespec ts;
+	long long due, deadline, idle_end = 0;
+	int ret;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->quit && (upinfo = upload_next(pool, &due)) == NULL) {
+			/* wake up for the next retry, or to close an idle connection */
+			deadline = due;
+			if (conn.fd >= 0) {
+				idle_end = conn.last_used + pool->opts.idle_timeout * 1000LL;
+				if (deadline == 0 || idle_end < deadline)
+					deadline = idle_end;
+			}
+			if (deadline == 0) {
+				pthread_cond_wait(&pool->cond, &pool->lock);
+				continue;
+			}
+			ts.tv_sec = deadline / 1000;
+			ts.tv_nsec = deadline % 1000 * 1000000;
+			pthread_cond_timedwait(&pool->cond, &pool->lock, &ts);
+			if (conn.fd >= 0 && now_ms() >= idle_end)
+				conn_close(&conn);
+		}
+		if (pool->quit)
+			break;
+		pthread_mutex_unlock(&pool->lock);
+
+		/* checked once, a retry goes straight to the upload */
+		check = upinfo->check;
+		upinfo->check = NULL;
+		if (check != NULL && check(upinfo) != 0) {
+			ret = 0;
+		} else {
+			ret = http_putfile(pool, upinfo, &conn);
+			if (upinfo->done != NULL)
+				upinfo->done(upinfo, ret);
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		upinfo->busy = 0;
+		if (upinfo->seq > 0 && ret == 0) {
+			spool_forget(pool, upinfo);
+		} else if (upinfo->seq > 0) {
+			spool_retry(pool, upinfo);
+			/* the other workers may be waiting without a deadline */
+			pthread_cond_signal(&pool->cond);
+		} else {
+			if (ret < 0)
+				fprintf(stderr, "upload of %s failed\n", upinfo->file);
+			upload_release(upinfo);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	conn_close(&conn);
+	return NULL;
+}
+#endif
+
+struct upload_pool *upload_pool_create(const struct upload_options *opts)
+{
+	struct upload_pool *pool = calloc(1, sizeof(*pool));
+#ifndef _MSC_VER
+	pthread_condattr_t attr;
+#endif
+	int i;
+
+	if (pool == NULL)
+		return NULL;
+	for (i = 0; i < UPLOAD_PRIO_MAX; i++)
+		INIT_LIST_HEAD(&pool->queues[i]);
+	INIT_LIST_HEAD(&pool->dns);
+	INIT_LIST_HEAD(&pool->spool);
+	pool->spool_fd = -1;
+	pool->opts = *opts;
+	if (pool->opts.workers <= 0)
+		pool->opts.workers = 1;
+	if (pool->opts.queue_size <= 0)
+		pool->opts.queue_size = 1;
+	if (opts->spool_dir != NULL)
+		pool->opts.spool_dir = strdup(opts->spool_dir);
+#ifndef _MSC_VER
+	pthread_mutex_init(&pool->lock, NULL);
+	/* idle timeouts are measured on the monotonic clock, see now_ms() */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&pool->cond, &attr);
+	pthread_cond_init(&pool->shape_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&pool->dns_cond, NULL);
+	pthread_cond_init(&pool->dns_done, NULL);
+	if (pool->opts.spool_dir != NULL && spool_open(pool) < 0) {
+		upload_pool_destroy(pool);
+		return NULL;
+	}
+	if (pthread_create(&pool->resolver, NULL, dns_thread, pool) != 0) {
+		printf("create resolver thread failed");
+		upload_pool_destroy(pool);
+		return NULL;
+	}
+	pool->resolver_started = 1;
+	pool->workers = calloc(pool->opts.workers, sizeof(pthread_t));
+	if (pool->workers == NULL) {
+		upload_pool_destroy(pool);
+		return NULL;
+	}
+	for (pool->nworkers = 0; pool->nworkers < pool->opts.workers; pool->nworkers++) {
+		if (pthread_create(&pool->workers[pool->nworkers], NULL, upload_worker, pool) != 0) {
+			printf("create upload thread failed");
+			upload_pool_destroy(pool);
+			return NULL;
+		}
+	}
+#endif
+	return pool;
+}
+
+#ifndef _MSC_VER
+/*
+ * The file of priority 'prio' to drop when the queue is full, the oldest or
+ * the newest as the overflow option says. Files in the spool are not
+ * counted in the queue size and are not dropped here, see spool_evict().
+ */
+static struct upload_info *upload_unspooled(struct upload_pool *pool, int prio)
+{
+	struct upload_info *upinfo;
+
+	if (pool->opts.overflow == UPLOAD_DROP_NEWEST) {
+		list_for_each_entry_reverse(upinfo, &pool->queues[prio], list)
+			if (upinfo->seq == 0)
+				return upinfo;
+	} else {
+		list_for_each_entry(upinfo, &pool->queues[prio], list)
+			if (upinfo->seq == 0)
+				return upinfo;
+	}
+	return NULL;
+}
+#endif
+
+int upload_submit(struct upload_pool *pool, struct upload_info *upinfo)
+{
+#ifdef _MSC_VER
+	/* no pool here, one thread per file */
+	HANDLE thread;
+
+	upinfo->pool = pool;
+	thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)upload_thread, (void *)upinfo, 0, NULL);
+
+	if (thread == NULL) {
+		upload_info_free(upinfo);
+		return -1;
+	}
+	CloseHandle(thread);
+	return 0;
+#else
+	struct upload_info *old = NULL;
+	int prio, ret, sync_fd;
+
+	if (upinfo->priority < 0 || upinfo->priority >= UPLOAD_PRIO_MAX)
+		upinfo->priority = UPLOAD_PRIO_NORMAL;
+	upinfo->pool = pool;
+	/* files in memory are not written to the spool, the others are moved in before locking */
+	if (pool->opts.spool_dir != NULL && upinfo->memfd < 0 && spool_move_in(pool, upinfo) == 0) {
+		pthread_mutex_lock(&pool->lock);
+		sync_fd = spool_add(pool, upinfo);
+		list_add_tail(&upinfo->list, &pool->queues[upinfo->priority]);
+		ret = spool_evict(pool, upinfo);
+		pthread_cond_signal(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+		/* the record has to survive a crash like the file */
+		if (sync_fd >= 0) {
+			if (fdatasync(sync_fd) < 0)
+				fprintf(stderr, "sync %s error: %s\n", pool->spool_index, strerror(errno));
+			close(sync_fd);
+		}
+		return ret;
+	}
+	pthread_mutex_lock(&pool->lock);
+	/* files in memory or that could not be spooled are held to the queue size */
+	if (pool->queued >= pool->opts.queue_size) {
+		/* make room in the lowest priority queued, unless the new file is lower */
+		for (prio = UPLOAD_PRIO_MAX - 1; prio >= 0; prio--)
+			if ((old = upload_unspooled(pool, prio)) != NULL)
+				break;
+		if (upinfo->priority > prio || (upinfo->priority == prio && pool->opts.overflow == UPLOAD_DROP_NEWEST)) {
+			pthread_mutex_unlock(&pool->lock);
+			upload_drop(upinfo);
+			return -1;
+		}
+		list_del(&old->list);
+		pool->queued--;
+	}
+	list_add_tail(&upinfo->list, &pool->queues[upinfo->priority]);
+	pool->queued++;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	if (old != NULL)
+		upload_drop(old);
+	return 0;
+#endif
+}
+
+void upload_pool_destroy(struct upload_pool *pool)
+{
+	struct upload_info *upinfo, *tmp;
+	struct dns_entry *e, *etmp;
+	int i;
+
+	if (pool == NULL)
+		return;
+#ifndef _MSC_VER
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_cond_broadcast(&pool->shape_cond);
+	pthread_cond_broadcast(&pool->dns_cond);
+	pthread_cond_broadcast(&pool->dns_done);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nworkers; i++)
+		pthread_join(pool->workers[i], NULL);
+	/* waits for a lookup in flight */
+	if (pool->resolver_started)
+		pthread_join(pool->resolver, NULL);
+	free(pool->workers);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->cond);
+	pthread_cond_destroy(&pool->shape_cond);
+	pthread_cond_destroy(&pool->dns_cond);
+	pthread_cond_destroy(&pool->dns_done);
+#endif
+	for (i = 0; i < UPLOAD_PRIO_MAX; i++) {
+		list_for_each_entry_safe(upinfo, tmp, &pool->queues[i], list) {
+			list_del(&upinfo->list);
+			if (upinfo->seq == 0)
+				upload_drop(upinfo);
+		}
+	}
+	/* files in the spool are kept for the next run */
+	list_for_each_entry_safe(upinfo, tmp, &pool->spool, spool_list) {
+		list_del(&upinfo->spool_list);
+		upload_info_free(upinfo);
+	}
+#ifndef _MSC_VER
+	if (pool->spool_fd >= 0)
+		close(pool->spool_fd);
+#endif
+	free(pool->spool_index);
+	free((char *)pool->opts.spool_dir);
+	list_for_each_entry_safe(e, etmp, &pool->dns, list) {
+		list_del(&e->list);
+		free(e->host);
+		free(e);
+	}
+	free(pool);
+}
+
+void upload_report_latency(struct upload_pool *pool, int latency)
+{
+#ifndef _MSC_VER
+	long long now = now_ms();
+
+	if (pool == NULL || pool->opts.latency_max <= 0)
+		return;
+	pthread_mutex_lock(&pool->lock);
+	if (now - pool->throttle_t >= THROTTLE_STEP) {
+		if (latency > pool->opts.latency_max && pool->throttle < THROTTLE_MAX) {
+			pool->throttle++;
+			pool->throttle_t = now;
+			fprintf(stderr, "agent latency %d ms, upload throttle level %d\n", latency, pool->throttle);
+		} else if (latency < pool->opts.latency_max / 2 && pool->throttle > 0) {
+			pool->throttle--;
+			pool->throttle_t = now;
+			fprintf(stderr, "agent latency %d ms, upload throttle level %d\n", latency, pool->throttle);
+			/* held back files may be taken again */
+			pthread_cond_broadcast(&pool->shape_cond);
+			pthread_cond_broadcast(&pool->cond);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+#endif
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2015, www.easyiot.com.cn
+ *
+ * The right to copy, distribute, modify, or otherwise make use
+ * of this software may be licensed only pursuant to the terms
+ * of an applicable license agreement.
+ *
+ */
+
+#ifndef __UPLOAD_H
+#define __UPLOAD_H
+
+#include "list.h"
+
+/*
+ * A file to be uploaded to the cloud server.
+ */
+struct upload_info {
+	struct list_head list;	/* in the queue of the pool */
+	char *host;
+	char *file;		/* only the name if the content is in memfd */
+	char *url;
+	int port;
+	int retry;
+	long long chunk_size;	/* larger files go in resumable chunks, 0 never */
+	int priority;		/* enum upload_priority */
+	int memfd;		/* the content, owned by the upload, or -1, see lib_sensor_file_fd() */
+	struct upload_pool *pool;	/* set by upload_submit() */
+	/*
+	 * called by the worker before the first try, the file is not uploaded
+	 * but released as if it was if it returns non-zero, may be NULL
+	 */
+	int (*check)(struct upload_info *upinfo);
+	/* called by the worker after each try with 0 if the file is uploaded, may be NULL */
+	void (*done)(struct upload_info *upinfo, int ret);
+	void *data;		/* for check and done */
+	void (*free_data)(void *data);	/* called when upinfo is freed, may be NULL */
+
+	/* in the spool, see upload_options.spool_dir */
+	struct list_head spool_list;	/* in the spool of the pool, oldest first */
+	long long seq;		/* of the index record, 0 when not in the spool */
+	long long size;
+	int attempts;		/* failed uploads so far */
+	long long due;		/* ms, not tried again before, see now_ms() */
+	int busy;		/* taken by a worker */
+};
+
+/* what to drop when a file comes in and the queue is full */
+enum upload_overflow {
+	UPLOAD_DROP_OLDEST = 0,
+	UPLOAD_DROP_NEWEST
+};
+
+/* which files go first, and which are held back while the agent link is slow */
+enum upload_priority {
+	UPLOAD_PRIO_HIGH = 0,
+	UPLOAD_PRIO_NORMAL,
+	UPLOAD_PRIO_LOW,
+	UPLOAD_PRIO_MAX
+};
+
+struct upload_options {
+	int workers;		/* upload threads */
+	int queue_size;		/* files waiting for a thread at most, not counting the spool */
+	int overflow;		/* enum upload_overflow */
+	int idle_timeout;	/* seconds a connection is kept for the next upload, 0 never */
+	int dns_ttl;		/* seconds the address of the server is used before it is looked up again */
+	long long rate;		/* bytes per second of all uploads together, 0 unlimited */
+	int latency_max;	/* ms of agent latency above which uploads back off, 0 never */
+	const char *spool_dir;	/* files wait here until uploaded, also across restarts, NULL never */
+	long long spool_quota;	/* bytes in the spool at most, the oldest files go first, 0 unlimited */
+};
+
+struct upload_pool;
+
+/*
+ * Start the upload threads of 'opts' taking files from a bounded queue,
+ * or from the spool if there is one. Files left in the spool by the last
+ * run are queued again.
+ */
+struct upload_pool *upload_pool_create(const struct upload_options *opts);
+
+/*
+ * Queue a file for upload, the pool owns 'upinfo' afterwards. Returns -1
+ * if the file was dropped. With a spool the file is moved into it.
+ */
+int upload_submit(struct upload_pool *pool, struct upload_info *upinfo);
+
+/*
+ * Stop the workers once their current upload is done, files still queued
+ * are dropped unless they are kept in the spool.
+ */
+void upload_pool_destroy(struct upload_pool *pool);
+
+void upload_info_free(struct upload_info *upinfo);
+
+/*
+ * Hash the content of a file (XXH64) to tell whether it changed since the
+ * last upload, the one in 'fd' if that is not -1. Returns -1 if the file
+ * cannot be read.
+ */
+int upload_hash(const char *file, int fd, unsigned long long *hash, long long *size);
+
+/*
+ * Tell the pool how long the agent takes to answer, in ms. Above
+ * upload_options.latency_max uploads are throttled step by step, below
+ * half of it they speed up again.
+ */
+void upload_report_latency(struct upload_pool *pool, int latency);
+
+#endif /* __UPLOAD_H */
@@ -0,0 +1,464 @@
+/*
+ * Copyright (C) 2015, www.easyiot.com.cn
+ *
+ * The right to copy, distribute, modify, or otherwise make use
+ * of this software may be licensed only pursuant to the terms
+ * of an applicable license agreement.
+ *
+ */
+
+/*
+ * mockcloud: a local stand-in for the file API of the cloud server, to try
+ * file datapoints without the real one. Point "cloudserveraddr" and
+ * "cloudserverport" of the sensor application at it.
+ *
+ * Files PUT to /api/file/<id>/<name> are stored as <id>_<name> in the
+ * directory given with -d. A PUT with "Content-Range: bytes a-b/size" is
+ * appended to <id>_<name>.part and answered with "308 Resume Incomplete"
+ * and the Range stored so far until the file is complete. An empty PUT
+ * whose Content-Range has "*" in place of a-b asks for that Range.
+ *
+ * -c drops each connection after the given number of body bytes, what is
+ * received up to there is kept, so resumed uploads can be tried.
+ *
+ * To measure uploads against something like a real uplink, -l delays each
+ * answer, -b limits the bytes per second received on all connections
+ * together, -f answers the given percentage of requests with a 500 and -n
+ * throws the bodies away instead of storing them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define HEADER_MAX 8192
+#define NAME_MAX_LEN 255
+
+static const char *store_dir = ".";
+static long long cut_bytes;
+static int latency;		/* ms, see -l */
+static long long bandwidth;	/* bytes per second, see -b */
+static int fail_percent;	/* see -f */
+static int discard;		/* see -n */
+
+/* when the link is free again, in ns on the monotonic clock, see throttle() */
+static pthread_mutex_t link_lock = PTHREAD_MUTEX_INITIALIZER;
+static long long link_free;
+
+struct client {
+	int fd;
+	char buf[HEADER_MAX];
+	size_t len;		/* bytes in buf not handled yet */
+	long long body_bytes;	/* body bytes on this connection, see -c */
+	unsigned int seed;	/* for -f */
+};
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_ns(long long ns)
+{
+	struct timespec ts;
+
+	if (ns <= 0)
+		return;
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+/*
+ * Hold a connection back until 'n' more bytes fit into -b, the bytes of
+ * all connections pass one after the other as over a single link.
+ */
+static void throttle(long long n)
+{
+	long long now, t;
+
+	if (bandwidth <= 0)
+		return;
+	pthread_mutex_lock(&link_lock);
+	now = now_ns();
+	if (link_free < now)
+		link_free = now;
+	link_free += n * 1000000000LL / bandwidth;
+	t = link_free;
+	pthread_mutex_unlock(&link_lock);
+	sleep_ns(t - now);
+}
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Read up to the end of a request header, return its length or -1 when
+ * the connection is closed.
+ */
+static int read_header(struct client *c)
+{
+	char *end;
+	ssize_t n;
+
+	for (;;) {
+		c->buf[c->len] = '\0';
+		end = strstr(c->buf, "\r\n\r\n");
+		if (end != NULL)
+			return end + 4 - c->buf;
+		if (c->len == sizeof(c->buf) - 1)
+			return -1;
+		n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		c->len += n;
+	}
+}
+
+static void consume(struct client *c, size_t n)
+{
+	memmove(c->buf, c->buf + n, c->len - n);
+	c->len -= n;
+}
+
+/* the value of header 'name' in the request header 'hdr', or NULL */
+static const char *find_header(const char *hdr, const char *name)
+{
+	size_t len = strlen(name);
+	const char *p;
+
+	for (p = strstr(hdr, "\r\n"); p != NULL; p = strstr(p, "\r\n")) {
+		p += 2;
+		if (strncasecmp(p, name, len) == 0 && p[len] == ':') {
+			p += len + 1;
+			while (*p == ' ' || *p == '\t')
+				p++;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Read a body of 'n' bytes and write it to 'out' unless it is -1. Returns
+ * -1 when the connection is closed or dropped because of -c.
+ */
+static int read_body(struct client *c, long long n, int out)
+{
+	char buf[64 << 10];
+	long long m;
+	ssize_t r;
+	int cut;
+
+	while (n > 0) {
+		if (c->len > 0) {
+			m = c->len < n ? (long long)c->len : n;
+			memcpy(buf, c->buf, m);
+			consume(c, m);
+		} else {
+			r = recv(c->fd, buf, n < (long long)sizeof(buf) ? n : (long long)sizeof(buf), 0);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0)
+				return -1;
+			m = r;
+		}
+		cut = cut_bytes > 0 && c->body_bytes + m >= cut_bytes;
+		if (cut)
+			m = cut_bytes - c->body_bytes;
+		throttle(m);
+		if (out >= 0 && write(out, buf, m) != m) {
+			perror("write");
+			return -1;
+		}
+		c->body_bytes += m;
+		n -= m;
+		if (cut && n > 0)
+			return -1;
+	}
+	return 0;
+}
+
+static long long file_size(const char *path)
+{
+	struct stat st;
+
+	return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+static int respond(struct client *c, int status, long long have)
+{
+	char msg[256], range[64] = "";
+	const char *reason;
+
+	switch (status) {
+	case 204: reason = "No Content"; break;
+	case 308: reason = "Resume Incomplete"; break;
+	case 400: reason = "Bad Request"; break;
+	case 405: reason = "Method Not Allowed"; break;
+	default: reason = "Internal Server Error"; break;
+	}
+	if (status == 308 && have > 0)
+		snprintf(range, sizeof(range), "Range: bytes=0-%lld\r\n", have - 1);
+	snprintf(msg, sizeof(msg), "HTTP/1.1 %d %s\r\n%sContent-Length: 0\r\n\r\n", status, reason, range);
+	sleep_ns(latency * 1000000LL);
+	return send_all(c->fd, msg, strlen(msg));
+}
+
+/*
+ * Handle one request, return its status or -1 if the connection is gone.
+ */
+static int handle_request(struct client *c, int hlen)
+{
+	char hdr[HEADER_MAX], method[16], name[NAME_MAX_LEN + 1], file[1024], part[1100];
+	long long clen = 0, first, last, total, have;
+	const char *v;
+	int id, fd, status;
+
+	memcpy(hdr, c->buf, hlen);
+	hdr[hlen] = '\0';
+	consume(c, hlen);
+
+	v = find_header(hdr, "Content-Length");
+	if (v != NULL)
+		clen = atoll(v);
+
+	if (sscanf(hdr, "%15s /api/file/%d/%255[^? ]", method, &id, name) != 3
+		|| strchr(name, '/') != NULL || name[0] == '.') {
+		status = 400;
+		goto drain;
+	}
+	if (strcmp(method, "PUT") != 0) {
+		status = 405;
+		goto drain;
+	}
+	if (fail_percent > 0 && rand_r(&c->seed) % 100 < (unsigned int)fail_percent) {
+		if (read_body(c, clen, -1) < 0)
+			return -1;
+		printf("PUT %d/%s: failed on purpose\n", id, name);
+		return respond(c, 500, 0) < 0 ? -1 : 500;
+	}
+	snprintf(file, sizeof(file), "%s/%d_%s", store_dir, id, name);
+	snprintf(part, sizeof(part), "%s.part", file);
+
+	v = find_header(hdr, "Content-Range");
+	if (v == NULL) {
+		/* the whole file in one go */
+		fd = open(part, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			perror(part);
+			status = 500;
+			goto drain;
+		}
+		if (read_body(c, clen, discard ? -1 : fd) < 0) {
+			close(fd);
+			unlink(part);
+			return -1;
+		}
+		/* -n: only the size is kept, as a sparse file */
+		if (discard && ftruncate(fd, clen) < 0)
+			perror(part);
+		close(fd);
+		rename(part, file);
+		status = respond(c, 204, 0) < 0 ? -1 : 204;
+		printf("PUT %d/%s %lld bytes: %d\n", id, name, clen, status);
+		return status;
+	}
+
+	if (sscanf(v, "bytes */%lld", &total) == 1) {
+		/* how far has the upload got */
+		if (read_body(c, clen, -1) < 0)
+			return -1;
+		have = file_size(part);
+		status = have < 0 && file_size(file) == total ? 204 : 308;
+		printf("PUT %d/%s query: %d, have %lld of %lld\n", id, name, status, have < 0 ? 0 : have, total);
+		return respond(c, status, have) < 0 ? -1 : status;
+	}
+
+	if (sscanf(v, "bytes %lld-%lld/%lld", &first, &last, &total) != 3
+		|| last < first || last >= total || last - first + 1 != clen) {
+		status = 400;
+		goto drain;
+	}
+	have = file_size(part);
+	if (have < 0)
+		have = 0;
+	if (first != have) {
+		/* not where the upload stands, tell the client */
+		if (read_body(c, clen, -1) < 0)
+			return -1;
+		printf("PUT %d/%s %lld-%lld: out of step, have %lld\n", id, name, first, last, have);
+		return respond(c, 308, have) < 0 ? -1 : 308;
+	}
+	fd = open(part, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd < 0) {
+		perror(part);
+		status = 500;
+		goto drain;
+	}
+	/* what came in is kept even if the connection drops */
+	have = c->body_bytes;
+	status = read_body(c, clen, discard ? -1 : fd);
+	if (discard && ftruncate(fd, first + c->body_bytes - have) < 0)
+		perror(part);
+	if (status < 0) {
+		close(fd);
+		printf("PUT %d/%s %lld-%lld: dropped, have %lld\n", id, name, first, last, file_size(part));
+		return -1;
+	}
+	close(fd);
+	if (last + 1 == total) {
+		rename(part, file);
+		status = 204;
+	} else {
+		status = 308;
+	}
+	printf("PUT %d/%s %lld-%lld/%lld: %d\n", id, name, first, last, total, status);
+	return respond(c, status, last + 1) < 0 ? -1 : status;
+
+drain:
+	if (read_body(c, clen, -1) < 0)
+		return -1;
+	printf("bad request: %.*s\n", (int)strcspn(hdr, "\r"), hdr);
+	return respond(c, status, 0) < 0 ? -1 : status;
+}
+
+static void *client_thread(void *arg)
+{
+	struct client *c = arg;
+	const char *v;
+	int hlen, keep;
+
+	pthread_detach(pthread_self());
+	while ((hlen = read_header(c)) > 0) {
+		v = find_header(c->buf, "Connection");
+		keep = v == NULL || strncasecmp(v, "close", 5) != 0;
+		if (handle_request(c, hlen) < 0 || !keep)
+			break;
+	}
+	close(c->fd);
+	free(c);
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	printf("usage: %s [-p port] [-d dir] [-c bytes] [-l ms] [-b bytes] [-f percent] [-n]\n"
+		"  -p port    port to listen on, 8080 by default\n"
+		"  -d dir     where uploaded files are stored, . by default\n"
+		"  -c bytes   drop each connection after this many body bytes\n"
+		"  -l ms      wait this long before each answer\n"
+		"  -b bytes   receive at most this many bytes per second in all\n"
+		"  -f percent answer this share of the uploads with 500\n"
+		"  -n         do not store the content, only the size of the files\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_in addr;
+	struct client *c;
+	pthread_t thr;
+	int opt, sock, port = 8080, on = 1;
+
+	while ((opt = getopt(argc, argv, "p:d:c:l:b:f:nh")) != -1) {
+		switch (opt) {
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'd':
+			store_dir = optarg;
+			break;
+		case 'c':
+			cut_bytes = atoll(optarg);
+			break;
+		case 'l':
+			latency = atoi(optarg);
+			break;
+		case 'b':
+			bandwidth = atoll(optarg);
+			break;
+		case 'f':
+			fail_percent = atoi(optarg);
+			break;
+		case 'n':
+			discard = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	signal(SIGPIPE, SIG_IGN);
+	srand(time(NULL));
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		return 1;
+	}
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 64) < 0) {
+		perror("bind");
+		return 1;
+	}
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	printf("mockcloud listening on port %d, storing files in %s\n", port, store_dir);
+
+	for (;;) {
+		c = calloc(1, sizeof(*c));
+		if (c == NULL) {
+			printf("Out of memory!");
+			return 1;
+		}
+		c->seed = rand();
+		c->fd = accept(sock, NULL, NULL);
+		if (c->fd < 0) {
+			free(c);
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			return 1;
+		}
+		if (pthread_create(&thr, NULL, client_thread, c) != 0) {
+			printf("create client thread failed");
+			close(c->fd);
+			free(c);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,319 @@
+/*
+ * Copyright (C) 2015, www.easyiot.com.cn
+ *
+ * The right to copy, distribute, modify, or otherwise make use
+ * of this software may be licensed only pursuant to the terms
+ * of an applicable license agreement.
+ *
+ */
+
+/*
+ * uploadbench: upload synthetic files through the upload pool of libsensor,
+ * upload_submit() and http_putfile() as doFileTransfer() uses them, to a
+ * server such as mockcloud. Reports the throughput, the latency of the
+ * uploads from submit to done, the CPU time per MB and the number of
+ * threads. The files are written before the clock starts.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "upload.h"
+
+struct bench_file {
+	long long submitted, done;	/* ns, see now_ns() */
+	int ret;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int ndone;
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static double cpu_seconds(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static int count_threads(void)
+{
+	DIR *dir = opendir("/proc/self/task");
+	struct dirent *d;
+	int n = 0;
+
+	if (dir == NULL)
+		return 0;
+	while ((d = readdir(dir)) != NULL)
+		if (d->d_name[0] != '.')
+			n++;
+	closedir(dir);
+	return n;
+}
+
+static void upload_done(struct upload_info *upinfo, int ret)
+{
+	struct bench_file *f = upinfo->data;
+
+	pthread_mutex_lock(&lock);
+	f->done = now_ns();
+	f->ret = ret;
+	ndone++;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+/* the next bytes of content that does not compress, different for each seed */
+static void fill(unsigned int *buf, size_t len, unsigned int *seed)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = *seed = *seed * 1103515245 + 12345;
+}
+
+/* 'size' bytes of content that does not compress, different for each file */
+static int write_file(const char *path, int memory, long long size, unsigned int seed)
+{
+	unsigned int buf[4096];
+	long long left;
+	size_t n;
+	int fd;
+
+#ifdef SYS_memfd_create
+	if (memory)
+		fd = syscall(SYS_memfd_create, "uploadbench", 0);
+	else
+#endif
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	for (left = size; left > 0; left -= n) {
+		fill(buf, sizeof(buf) / sizeof(buf[0]), &seed);
+		n = left < (long long)sizeof(buf) ? left : (long long)sizeof(buf);
+		if (write(fd, buf, n) != (ssize_t)n) {
+			close(fd);
+			return -1;
+		}
+	}
+	if (memory)
+		return fd;
+	close(fd);
+	return 0;
+}
+
+/* whether 'path' holds exactly what write_file() wrote with 'seed' */
+static int check_file(const char *path, long long size, unsigned int seed)
+{
+	unsigned int want[4096];
+	char buf[sizeof(want)];
+	long long left;
+	size_t n, got;
+	ssize_t r;
+	int fd, same = 1;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	for (left = size; same && left > 0; left -= n) {
+		fill(want, sizeof(want) / sizeof(want[0]), &seed);
+		n = left < (long long)sizeof(want) ? left : (long long)sizeof(want);
+		for (got = 0; got < n; got += r) {
+			r = read(fd, buf + got, n - got);
+			if (r <= 0)
+				break;
+		}
+		same = got == n && memcmp(buf, want, n) == 0;
+	}
+	/* nothing after the content either */
+	if (same && read(fd, buf, 1) != 0)
+		same = 0;
+	close(fd);
+	return same;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void usage(const char *prog)
+{
+	printf("usage: %s [-s host] [-p port] [-n files] [-z bytes] [-w workers] [-r rate] [-k bytes] [-i seconds] [-m] [-c dir]\n"
+		"  -s host     server to upload to, 127.0.0.1 by default\n"
+		"  -p port     its port, 8080 by default\n"
+		"  -n files    files to upload, 100 by default\n"
+		"  -z bytes    size of each file, 1048576 by default\n"
+		"  -w workers  upload threads, 2 by default\n"
+		"  -r rate     bytes per second of all uploads, unlimited by default\n"
+		"  -k bytes    upload files in chunks of this size\n"
+		"  -i seconds  idle timeout of the connections, 0 to not reuse them, 30 by default\n"
+		"  -m          keep the files in memory (memfd) instead of /tmp\n"
+		"  -c dir      check the files mockcloud stored in dir have the content sent\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct upload_options opts = { 2, 0, UPLOAD_DROP_OLDEST, 30, 300, 0, 0, NULL, 0 };
+	const char *host = "127.0.0.1", *check_dir = NULL;
+	int port = 8080, nfiles = 100, memory = 0, threads, threads_max = 0, failed = 0;
+	long long size = 1 << 20, chunk_size = 0, t0, t1, *lat;
+	char dir[] = "/tmp/uploadbench.XXXXXX", path[64], stored[1024];
+	struct upload_info *upinfo, **uploads;
+	struct bench_file *files;
+	struct upload_pool *pool;
+	struct rusage ru0, ru1;
+	struct timespec ts;
+	double secs, mb, cpu;
+	int opt, i, n, fd, bad = 0;
+
+	while ((opt = getopt(argc, argv, "s:p:n:z:w:r:k:i:mc:h")) != -1) {
+		switch (opt) {
+		case 's': host = optarg; break;
+		case 'p': port = atoi(optarg); break;
+		case 'n': nfiles = atoi(optarg); break;
+		case 'z': size = atoll(optarg); break;
+		case 'w': opts.workers = atoi(optarg); break;
+		case 'r': opts.rate = atoll(optarg); break;
+		case 'k': chunk_size = atoll(optarg); break;
+		case 'i': opts.idle_timeout = atoi(optarg); break;
+		case 'm': memory = 1; break;
+		case 'c': check_dir = optarg; break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (nfiles <= 0 || size < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	opts.queue_size = nfiles;
+
+	files = calloc(nfiles, sizeof(*files));
+	uploads = calloc(nfiles, sizeof(*uploads));
+	lat = calloc(nfiles, sizeof(*lat));
+	if (files == NULL || uploads == NULL || lat == NULL || (!memory && mkdtemp(dir) == NULL)) {
+		perror("uploadbench");
+		return 1;
+	}
+	for (i = 0; i < nfiles; i++) {
+		snprintf(path, sizeof(path), "%s/file%d", dir, i);
+		fd = write_file(path, memory, size, i);
+		upinfo = calloc(1, sizeof(*upinfo));
+		if (fd < 0 || upinfo == NULL) {
+			perror(path);
+			return 1;
+		}
+		upinfo->file = strdup(memory ? path + strlen(dir) + 1 : path);
+		upinfo->memfd = memory ? fd : -1;
+		upinfo->host = strdup(host);
+		upinfo->port = port;
+		if (asprintf(&upinfo->url, "/api/file/1/file%d", i) < 0)
+			upinfo->url = NULL;
+		upinfo->retry = 5;
+		upinfo->chunk_size = chunk_size;
+		upinfo->priority = UPLOAD_PRIO_NORMAL;
+		upinfo->done = upload_done;
+		upinfo->data = &files[i];
+		uploads[i] = upinfo;
+	}
+
+	pool = upload_pool_create(&opts);
+	if (pool == NULL) {
+		printf("create upload pool failed\n");
+		return 1;
+	}
+	getrusage(RUSAGE_SELF, &ru0);
+	t0 = now_ns();
+	for (i = 0; i < nfiles; i++) {
+		files[i].submitted = now_ns();
+		if (upload_submit(pool, uploads[i]) < 0) {
+			files[i].ret = -1;
+			pthread_mutex_lock(&lock);
+			ndone++;
+			pthread_mutex_unlock(&lock);
+		}
+	}
+
+	/* count the threads while the uploads run */
+	pthread_mutex_lock(&lock);
+	while (ndone < nfiles) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 10000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&cond, &lock, &ts);
+		pthread_mutex_unlock(&lock);
+		threads = count_threads();
+		if (threads > threads_max)
+			threads_max = threads;
+		pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
+	t1 = now_ns();
+	getrusage(RUSAGE_SELF, &ru1);
+	upload_pool_destroy(pool);
+	if (!memory)
+		rmdir(dir);
+
+	for (i = n = 0; i < nfiles; i++) {
+		if (files[i].ret < 0)
+			failed++;
+		else
+			lat[n++] = files[i].done - files[i].submitted;
+	}
+	qsort(lat, n, sizeof(*lat), cmp_ll);
+	secs = (t1 - t0) / 1e9;
+	mb = (double)n * size / (1 << 20);
+	cpu = cpu_seconds(&ru1.ru_utime) - cpu_seconds(&ru0.ru_utime)
+		+ cpu_seconds(&ru1.ru_stime) - cpu_seconds(&ru0.ru_stime);
+
+	printf("%d files of %lld bytes, %d workers, %s\n", nfiles, size, opts.workers, memory ? "in memory" : "on disk");
+	printf("uploaded:   %d, %d failed, %.1f MB in %.3f s\n", n, failed, mb, secs);
+	printf("throughput: %.2f MB/s, %.1f files/s\n", mb / secs, n / secs);
+	if (n > 0)
+		printf("latency:    p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+			lat[n / 2] / 1e6, lat[n * 9 / 10] / 1e6, lat[n * 99 / 100] / 1e6, lat[n - 1] / 1e6);
+	printf("cpu:        %.3f s user, %.3f s sys, %.2f ms per MB\n",
+		cpu_seconds(&ru1.ru_utime) - cpu_seconds(&ru0.ru_utime),
+		cpu_seconds(&ru1.ru_stime) - cpu_seconds(&ru0.ru_stime), mb > 0 ? cpu * 1000 / mb : 0);
+	printf("threads:    %d at most\n", threads_max);
+
+	/* mockcloud stores /api/file/1/file0 as 1_file0 */
+	for (i = 0; check_dir != NULL && i < nfiles; i++) {
+		snprintf(stored, sizeof(stored), "%s/1_file%d", check_dir, i);
+		if (files[i].ret == 0 && !check_file(stored, size, i)) {
+			printf("%s does not have the content sent\n", stored);
+			bad++;
+		}
+	}
+	if (check_dir != NULL)
+		printf("checked:    %d files, %d bad\n", n, bad);
+
+	free(files);
+	free(uploads);
+	free(lat);
+	return failed > 0 || bad > 0;
+}
@@ -143,16 +143,10 @@ static int do_read_from_serial(unsigned char *buf, int fd)
  * Get datapoint data according to datapoint properties.
  * Here we fake the data using random numbers.
  */
-void * get_datapoint_data(void *props)
+int get_datapoint_sample(void *props, struct lib_sensor_sample *sample)
 {
 	float temperature = 0.0;
-	void *ret = NULL;
 	const char *name = get_string_by_name(props, "name");
-	ret = malloc(sizeof(double));
-	if (ret == NULL) {
-		perror("No memory available.\n");
-		exit(-1);
-	}
 
 	if (strcmp(name, "grove_temperature") == 0) {
 		/* the temperature sensor's output connect to a0 pin of
@@ -175,21 +169,21 @@ void * get_datapoint_data(void *props)
 		}
 		printf("The temperature is: %2.2f c\n", temperature);
 		/* return the temperature to libsensor */
-		*(double *)ret = (double)temperature;
+		sample->value.numeric = (double)temperature;
 	} else if (strcmp(name, "grove_light") == 0) {
 		int a1v = galileo_analog_read(1);
 		printf("Readed a1 pin voltage: %1.2f\n", ((double)a1v * 5) / 4096);
 
 		int val = a1v / 4;
 		printf("The light number is: %2.2f\n", (double)val);
-		*(double *)ret = (double)val;
+		sample->value.numeric = (double)val;
 	} else if (strcmp(name, "grove_sound") == 0) {
 		int a2v = galileo_analog_read(2);
 		printf("Readed a2 pin voltage: %1.2f\n", ((double)a2v * 5) / 4096);
 
 		int val = a2v / 4;
 		printf("The sound number is: %2.2f\n", (double)val);
-		*(double *)ret = (double)val;
+		sample->value.numeric = (double)val;
 	} else if (strcmp(name, "lm35-temperature") == 0) {
 		int a0v = galileo_analog_read(0);
 		/* get voltage */
@@ -199,49 +193,45 @@ void * get_datapoint_data(void *props)
 		/* the lm35 output voltage is 10mV per degree, from 0 to 100 C */
 		double temperature = (val * 5 / 1024) * 100.00;
 		printf("The lm35 temperature is: %2.2f C\n", temperature);
-		*(double *)ret = temperature;
+		sample->value.numeric = temperature;
 	} else if (strcmp(name, "oc_image") == 0) {
 		struct timeb t;
 		ftime(&t);
 		/* prepare a image file then return its name to libsensor */
-		char *file = NULL;
+		char *file = sample->value.file;
 		char *cmd = NULL;
-		/* note, according to asprintf, the 'file' need be freed
-		   later, which will be done by libsensor */
-		asprintf(&file, "image_%lld%s", 1000 * (long long)t.time + t.millitm, ".jpg");
+		snprintf(file, sizeof(sample->value.file), "image_%lld%s", 1000 * (long long)t.time + t.millitm, ".jpg");
 		asprintf(&cmd, "capture %s 2>/dev/null", file);
 		system(cmd);
 		free(cmd);
 		cmd = NULL;
-		ret = (void*)file;
 	} else if (strcmp(name, "image") == 0) {
 		struct timeb t;
 		ftime(&t);
 		/* prepare a image file then return its name to libsensor */
-		char *file = NULL;
+		char *file = sample->value.file;
 		char *cmd = NULL;
-		/* note, according to asprintf, the 'file' need be freed
-		   later, which will be done by libsensor */
-		asprintf(&file, "image_%lld%s", 1000 * (long long)t.time + t.millitm, ".jpg");
+		snprintf(file, sizeof(sample->value.file), "image_%lld%s", 1000 * (long long)t.time + t.millitm, ".jpg");
 		asprintf(&cmd, "fswebcam -r 1280x720 --save %s 2>/dev/null", file);
 		system(cmd);
 		free(cmd);
 		cmd = NULL;
-		ret = (void*)file;
 	} else if (strcmp(name, "serial_test") == 0) {
 		unsigned char buf[32] = {};
 		int fd = init_serial_port(SERISL_DEVICE);
 		if (fd < 0) {
-			*(double *)ret = 0;
+			sample->value.numeric = 0;
 		} else {
 			int len = do_read_from_serial(buf, fd);
 			dump_str(buf, len);
-			*(double *)ret = 1;
+			sample->value.numeric = 1;
 		}
 		clean_serial_port(fd);
+	} else {
+		return -1;
 	}
 
-	return ret;
+	return 0;
 }
 
 int main(int argc, char *argv[])
@@ -264,7 +254,7 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	lib_sensor_start(config_file, get_datapoint_data, NULL, NULL);
+	lib_sensor_start_ex(config_file, get_datapoint_sample, NULL, NULL);
 
 	printf("sensor app is terminated!\n");
 	return 0;
@@ -42,6 +42,9 @@
 
 const char *default_cfg = "smartfarm.json";
 
+/* handles of the props read on every sample */
+static lib_sensor_prop_t prop_name, prop_mbdev, prop_sdev;
+
 void usage()
 {
 	printf("Usage: [-h] [-f] [-c <configuration-file>]\n\n"
@@ -284,22 +287,50 @@ int get_airpmindex(const char *dev_name, int type)
 		return 0;
 }
 
+/*
+ * Take a picture with fswebcam writing it to stdout and hand it to
+ * libsensor as an in-memory file.
+ */
+static int capture_image(struct lib_sensor_sample *sample)
+{
+	FILE *fp = popen("fswebcam -c /etc/fswebcam.conf --save - 2>/dev/null", "r");
+	char *buf = NULL, *p;
+	size_t len = 0, size = 0, n;
+	int ret = -1;
+
+	if (fp == NULL)
+		return -1;
+	for (;;) {
+		if (len == size) {
+			p = realloc(buf, size ? 2 * size : 64 << 10);
+			if (p == NULL) {
+				len = 0;
+				break;
+			}
+			buf = p;
+			size = size ? 2 * size : 64 << 10;
+		}
+		n = fread(buf + len, 1, size - len, fp);
+		if (n == 0)
+			break;
+		len += n;
+	}
+	if (pclose(fp) == 0 && len > 0)
+		ret = lib_sensor_file_data(sample, buf, len);
+	free(buf);
+	return ret;
+}
+
 /*
  * Get datapoint data according to datapoint properties.
  * Here we fake the data using random numbers.
  */
-void * get_datapoint_data(void *props)
+int get_datapoint_sample(void *props, struct lib_sensor_sample *sample)
 {
-	void *ret = NULL;
-	const char *name = get_string_by_name(props, "name");
-	ret = malloc(sizeof(double));
-	if (ret == NULL) {
-		perror("No memory available.\n");
-		exit(-1);
-	}
+	const char *name = lib_sensor_prop_string(sample, prop_name);
 
 	if (strcmp(name, "temperature") == 0) {
-		const char *mbd = get_string_by_name(props, "mbdev");
+		const char *mbd = lib_sensor_prop_string(sample, prop_mbdev);
 	    // 485 device address:3
 	    // temperature register address: 1
 		int val = get_mbsensor_data(mbd, 3, 1);
@@ -308,10 +339,10 @@ void * get_datapoint_data(void *props)
 	    printf("Temperature is %2.2f C degree\n", temperature);
 
 	    // return value to libsensor
-	    *(double *)ret = (double)temperature;
+	    sample->value.numeric = (double)temperature;
 
 	}else if (strcmp(name, "humidity") == 0) {
-		const char *mbd = get_string_by_name(props, "mbdev");
+		const char *mbd = lib_sensor_prop_string(sample, prop_mbdev);
 	    // 485 device address:3
 	    // humidity register address: 0
 		int val = get_mbsensor_data(mbd, 3, 0);
@@ -320,11 +351,11 @@ void * get_datapoint_data(void *props)
 	    printf("Humidity is %2.2f percent\n", humidity);
 	    
 	    // return value to libsensor
-	    *(double *)ret = (double)humidity;
+	    sample->value.numeric = (double)humidity;
 
 	} else if (strcmp(name, "pm2d5index") == 0) {
 		static double pm2d5 = 0.0;
-		const char *devn = get_string_by_name(props, "sdev");
+		const char *devn = lib_sensor_prop_string(sample, prop_sdev);
 	    // convert to ug/m3
 		double _pm2d5 = 0.0;
 		int retry = 5;
@@ -335,16 +366,19 @@ void * get_datapoint_data(void *props)
 
 		if (_pm2d5 > 5 && _pm2d5 < 500) {
 			pm2d5 = _pm2d5;
+		} else {
+			/* read failed, report the last good value */
+			sample->status = LIB_SENSOR_STALE;
 		}
 
 		printf("PM2.5 is %2.2f ug/m3\n", pm2d5);
 	    
 	    // return value to libsensor
-	    *(double *)ret = (double)pm2d5;
+	    sample->value.numeric = (double)pm2d5;
 
 	} else if (strcmp(name, "pm10index") == 0) {
 		static double pm10 = 0.0;
-		const char *devn = get_string_by_name(props, "sdev");
+		const char *devn = lib_sensor_prop_string(sample, prop_sdev);
 
 		double _pm10 = 0.0;
 
@@ -356,12 +390,15 @@ void * get_datapoint_data(void *props)
 
 		if (_pm10 > 5 && _pm10 < 500) {
 			pm10 = _pm10;
+		} else {
+			/* read failed, report the last good value */
+			sample->status = LIB_SENSOR_STALE;
 		}
 
 	    printf("PM10 is %2.2f ug/m3\n", pm10);
 	    
 	    // return value to libsensor
-	    *(double *)ret = (double)pm10;
+	    sample->value.numeric = (double)pm10;
 
 	} else if (strcmp(name, "light") == 0) {
 		/* the light sensor's output connect to a2 pin of
@@ -381,25 +418,28 @@ void * get_datapoint_data(void *props)
 		printf("The light is: %2.2f lux\n", light);
 
 		/* return the temperature to libsensor */
-		*(double *)ret = (double)light;
+		sample->value.numeric = (double)light;
 
 	} else if (strcmp(name, "image") == 0) {
 		struct timeb t;
 		ftime(&t);
 		/* prepare a image file then return its name to libsensor */
-		char *file = NULL;
+		char *file = sample->value.file;
 		char *cmd = NULL;
-		/* note, according to asprintf, the 'file' need be freed
-		   later, which will be done by libsensor */
-		asprintf(&file, "image_%lld%s", 1000 * (long long)t.time + t.millitm, ".jpg");
+		snprintf(file, sizeof(sample->value.file), "image_%lld%s", 1000 * (long long)t.time + t.millitm, ".jpg");
+
+		/* keep the image in memory to spare the SD card, a file if that fails */
+		if (capture_image(sample) == 0)
+			return 0;
 		asprintf(&cmd, "fswebcam -c /etc/fswebcam.conf --save %s 2>/dev/null", file);
 		system(cmd);
 		free(cmd);
 		cmd = NULL;
-		ret = (void*)file;
+	} else {
+		return -1;
 	}
 
-	return ret;
+	return 0;
 }
 
 int main(int argc, char *argv[])
@@ -422,7 +462,10 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	lib_sensor_start(config_file, get_datapoint_data, NULL, NULL);
+	prop_name = lib_sensor_prop("name");
+	prop_mbdev = lib_sensor_prop("mbdev");
+	prop_sdev = lib_sensor_prop("sdev");
+	lib_sensor_start_ex(config_file, get_datapoint_sample, NULL, NULL);
 
 	printf("sensor app is terminated!\n");
 	return 0;
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2015, www.easyiot.com.cn
+ *
+ * The right to copy, distribute, modify, or otherwise make use
+ * of this software may be licensed only pursuant to the terms
+ * of an applicable license agreement.
+ *
+ * virtsensor written with the C++ wrapper of lib_sensor.hpp: each kind of
+ * datapoint is a driver type, the wrapper creates one driver object per
+ * datapoint and binds the props it declares to its members. The object is
+ * created on the first sample and recreated when the props change.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include "lib_sensor.hpp"
+
+static const char *default_cfg = "virtsensor-cpp.json";
+
+/* a random value between 'min' and 'max' */
+static double fake(double min, double max)
+{
+	return min + (max - min) * std::rand() / (RAND_MAX + 1.0);
+}
+
+/* numeric datapoints faked within their "dataRangeMin" and "dataRangeMax" */
+struct ranged {
+	double min = 0;
+	double max = 100;
+
+	int sample(lib_sensor_sample &s)
+	{
+		s.value.numeric = fake(min, max);
+		return 0;
+	}
+};
+
+struct temperature : ranged {
+	static const char *name() { return "temperature"; }
+
+	void bind(libsensor::binder<temperature> &b)
+	{
+		b.prop("dataRangeMin", &temperature::min).prop("dataRangeMax", &temperature::max);
+	}
+};
+
+struct humidity : ranged {
+	static const char *name() { return "humidity"; }
+
+	void bind(libsensor::binder<humidity> &b)
+	{
+		b.prop("dataRangeMin", &humidity::min).prop("dataRangeMax", &humidity::max);
+	}
+};
+
+/* a vector of "fields" faked within +-"range" g */
+struct acceleration {
+	static const char *name() { return "acceleration"; }
+
+	double range = 2;
+
+	void bind(libsensor::binder<acceleration> &b)
+	{
+		b.prop("range", &acceleration::range);
+	}
+
+	int sample(lib_sensor_sample &s)
+	{
+		for (int i = 0; i < s.value.vector.n; i++)
+			s.value.vector.v[i] = fake(-range, range);
+		return 0;
+	}
+};
+
+static void usage()
+{
+	std::printf("Usage: [-h] [-c <configuration-file>]\n\n"
+			"Options:\n"
+			"  -c Configuration file.\n"
+			"  -h Print this Help\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *config_file = default_cfg;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "hc:")) != -1) {
+		switch (ch) {
+			case 'h':
+				usage();
+				return 0;
+			case 'c':
+				config_file = optarg;
+				break;
+			default:
+				usage();
+				return 1;
+		}
+	}
+
+	try {
+		libsensor::sensor<temperature, humidity, acceleration> app(config_file);
+
+		app.run();
+	} catch (const std::exception &e) {
+		std::fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	std::printf("sensor app is terminated!\n");
+	return 0;
+}
@@ -101,6 +101,9 @@ char	**argv, *opts;
 
 const char *default_cfg = "virtsensor.json";
 
+/* handle of the "name" prop */
+static lib_sensor_prop_t prop_name;
+
 void usage()
 {
 	printf("Usage: [-h] [-f] [-c <configuration-file>]\n\n"
@@ -113,30 +116,32 @@ void usage()
  * Get datapoint data according to datapoint properties.
  * Here we fake the data using random numbers.
  */
-void * get_datapoint_data(void *props)
+int get_datapoint_sample(void *props, struct lib_sensor_sample *sample)
 {
-	void *ret = NULL;
-	const char *name = get_string_by_name(props, "name");
+	const char *name = lib_sensor_prop_string(sample, prop_name);
 
 	if (strcmp(name, "temperature") == 0) {
-		ret = malloc(sizeof(double));
-		*(double *)ret = (150.0 * rand() / (RAND_MAX + 1.0) - 50);
+		sample->value.numeric = (150.0 * rand() / (RAND_MAX + 1.0) - 50);
 	} else if (strcmp(name, "humidity") == 0) {
-		ret = malloc(sizeof(double));
-		*(double *)ret = (100.0 * rand() / (RAND_MAX + 1.0));
+		sample->value.numeric = (100.0 * rand() / (RAND_MAX + 1.0));
+	} else if (strcmp(name, "acceleration") == 0) {
+		int i;
+
+		for (i = 0; i < sample->value.vector.n; i++)
+			sample->value.vector.v[i] = (4.0 * rand() / (RAND_MAX + 1.0) - 2);
 	} else if (strcmp(name, "image") == 0) {
-		struct timeb t;
-		ftime(&t);
-		char *file = NULL;
-		asprintf(&file, "image_%lld", 1000 * (long long)t.time + t.millitm);
+		snprintf(sample->value.file, sizeof(sample->value.file), "image_%lld", sample->timestamp);
 		char buf[] = {'a','b','c'};
-		FILE *fp = fopen(file, "w");
+		FILE *fp = fopen(sample->value.file, "w");
+		if (fp == NULL)
+			return -1;
 		fwrite (buf, sizeof(buf), 1, fp);
 		fclose(fp);
-		ret = (void*)file;
+	} else {
+		return -1;
 	}
 
-	return ret;
+	return 0;
 }
 
 int main(int argc, char *argv[])
@@ -159,7 +164,8 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	lib_sensor_start(config_file, get_datapoint_data, NULL, NULL);
+	prop_name = lib_sensor_prop("name");
+	lib_sensor_start_ex(config_file, get_datapoint_sample, NULL, NULL);
 
 	printf("sensor app is terminated!\n");
 	return 0;